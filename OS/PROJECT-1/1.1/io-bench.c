@@ -0,0 +1,326 @@
+#define _GNU_SOURCE // O_DIRECT, MAP_POPULATE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// I/O strategy benchmark for the single-process counters of 1.1
+// Every variant counts the same character over the whole file, once with the
+// file in the page cache (warm) and once after dropping it (cold).
+// Build: gcc -O2 -o io-bench io-bench.c
+// Usage: ./io-bench <file> [character] [repeats]
+// Cold runs drop the file with posix_fadvise(DONTNEED), which only works on
+// clean pages; as root /proc/sys/vm/drop_caches is also used.
+
+#define MIN_READ_SIZE 1024 // read() buffer sizes: 1KB ... 16MB
+#define MAX_READ_SIZE (16 * 1024 * 1024)
+#define STDIO_CHUNK (64 * 1024) // fread() request size
+#define DIRECT_ALIGN 4096 // O_DIRECT buffer/offset alignment
+
+typedef long (*Variant)(const char *path, char c2c, size_t size);
+
+// Counters of one run
+typedef struct {
+    long count;
+    double seconds;
+    long syscalls; // read-type syscalls (syscr of /proc/self/io)
+    long faults; // minor + major page faults
+} Result;
+
+long count_in(const unsigned char *buf, size_t len, unsigned char c2c) {
+    long count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == c2c) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Number of read syscalls of this process so far, -1 if /proc/self/io is missing
+long read_syscalls() {
+    char line[128];
+    long value = -1;
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "syscr: %ld", &value) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+long page_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+// Drop the file from the page cache
+void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (geteuid() == 0) {
+        int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (dc != -1) {
+            sync();
+            write(dc, "1\n", 2);
+            close(dc);
+        }
+    }
+}
+
+// Read the whole file, so the warm runs find it in the page cache
+void warm_cache(const char *path) {
+    static char buffer[1024 * 1024];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    close(fd);
+}
+
+// --- stdio variants, as in Lib-Code.c ---
+
+long run_fgetc(const char *path, char c2c, size_t size) {
+    (void)size;
+    FILE *fp = fopen(path, "r");
+    long count = 0;
+    int cc;
+    if (fp == NULL) {
+        return -1;
+    }
+    while ((cc = fgetc(fp)) != EOF) if (cc == (unsigned char)c2c) count++;
+    fclose(fp);
+    return count;
+}
+
+long run_getc_unlocked(const char *path, char c2c, size_t size) {
+    (void)size;
+    FILE *fp = fopen(path, "r");
+    long count = 0;
+    int cc;
+    if (fp == NULL) {
+        return -1;
+    }
+    while ((cc = getc_unlocked(fp)) != EOF) if (cc == (unsigned char)c2c) count++;
+    fclose(fp);
+    return count;
+}
+
+long run_fread(const char *path, char c2c, size_t size) {
+    (void)size;
+    static unsigned char buffer[STDIO_CHUNK];
+    FILE *fp = fopen(path, "r");
+    long count = 0;
+    size_t n;
+    if (fp == NULL) {
+        return -1;
+    }
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        count += count_in(buffer, n, c2c);
+    }
+    fclose(fp);
+    return count;
+}
+
+// --- read() with a given buffer size, as in No-Lib_code.c ---
+
+size_t read_size; // Buffer size of the current read() run
+
+long run_read(const char *path, char c2c, size_t size) {
+    (void)size;
+    unsigned char *buffer = malloc(read_size);
+    int fd = open(path, O_RDONLY);
+    long count = 0;
+    ssize_t n;
+    if (fd == -1 || buffer == NULL) {
+        free(buffer);
+        return -1;
+    }
+    while ((n = read(fd, buffer, read_size)) > 0) {
+        count += count_in(buffer, n, c2c);
+    }
+    close(fd);
+    free(buffer);
+    return (n == -1) ? -1 : count;
+}
+
+// --- mmap ---
+
+long mmap_count(const char *path, char c2c, size_t size, int flags) {
+    int fd = open(path, O_RDONLY);
+    long count;
+    if (fd == -1) {
+        return -1;
+    }
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | flags, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (!(flags & MAP_POPULATE)) {
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    count = count_in(map, size, c2c);
+    munmap(map, size);
+    return count;
+}
+
+long run_mmap(const char *path, char c2c, size_t size) {
+    return mmap_count(path, c2c, size, 0);
+}
+
+long run_mmap_populate(const char *path, char c2c, size_t size) {
+    return mmap_count(path, c2c, size, MAP_POPULATE);
+}
+
+// --- O_DIRECT: bypasses the page cache, so warm and cold should match ---
+
+long run_direct(const char *path, char c2c, size_t size) {
+    const size_t chunk = 4 * 1024 * 1024;
+    void *buffer;
+    long count = 0;
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd == -1) {
+        return -1; // e.g. tmpfs does not support O_DIRECT
+    }
+    if (posix_memalign(&buffer, DIRECT_ALIGN, chunk) != 0) {
+        close(fd);
+        return -1;
+    }
+    // The last read may be short; O_DIRECT still returns the bytes up to EOF
+    while ((n = read(fd, buffer, chunk)) > 0) {
+        count += count_in(buffer, n, c2c);
+    }
+    (void)size;
+    free(buffer);
+    close(fd);
+    return (n == -1) ? -1 : count;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run one variant, keep the fastest of the repeats
+Result measure(Variant run, const char *path, char c2c, size_t size, int cold, int repeats) {
+    Result best = { .count = -1, .seconds = -1 };
+    for (int r = 0; r < repeats; r++) {
+        if (cold) {
+            drop_cache(path);
+        }
+        else {
+            warm_cache(path);
+        }
+        long sys0 = read_syscalls();
+        long flt0 = page_faults();
+        double t0 = now();
+        long count = run(path, c2c, size);
+        double t1 = now();
+        long sys1 = read_syscalls();
+        long flt1 = page_faults();
+        if (count < 0) {
+            best.count = -1;
+            return best;
+        }
+        if (best.seconds < 0 || t1 - t0 < best.seconds) {
+            best.count = count;
+            best.seconds = t1 - t0;
+            best.syscalls = (sys0 < 0) ? -1 : sys1 - sys0;
+            best.faults = flt1 - flt0;
+        }
+    }
+    return best;
+}
+
+void report(const char *name, Result res, size_t size, int cold) {
+    double gb = size / 1e9;
+    if (res.count < 0) {
+        printf("%-22s %-5s %10s\n", name, cold ? "cold" : "warm", "n/a");
+        return;
+    }
+    printf("%-22s %-5s %10.3f %14.0f %12.0f %12ld\n", name, cold ? "cold" : "warm",
+           gb / res.seconds, (res.syscalls < 0) ? -1.0 : res.syscalls / gb, res.faults / gb, res.count);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s <file> [character] [repeats]\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[1];
+    char c2c = (argc > 2) ? argv[2][0] : 'a';
+    int repeats = (argc > 3) ? atoi(argv[3]) : 3;
+    if (repeats < 1) {
+        repeats = 1;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror("stat failed");
+        return 1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        fprintf(stderr, "Empty file, nothing to measure\n");
+        return 1;
+    }
+
+    printf("File: %s (%zu bytes), character '%c', best of %d\n\n", path, size, c2c, repeats);
+    printf("%-22s %-5s %10s %14s %12s %12s\n", "variant", "cache", "GB/s", "syscalls/GB", "faults/GB", "count");
+
+    struct {
+        const char *name;
+        Variant run;
+    } fixed[] = {
+        { "fgetc", run_fgetc },
+        { "getc_unlocked", run_getc_unlocked },
+        { "fread 64KB", run_fread },
+    };
+
+    for (int cold = 0; cold <= 1; cold++) {
+        for (size_t k = 0; k < sizeof(fixed) / sizeof(fixed[0]); k++) {
+            report(fixed[k].name, measure(fixed[k].run, path, c2c, size, cold, repeats), size, cold);
+        }
+        for (read_size = MIN_READ_SIZE; read_size <= MAX_READ_SIZE; read_size *= 4) {
+            char name[32];
+            if (read_size < 1024 * 1024) {
+                snprintf(name, sizeof(name), "read %zuKB", read_size / 1024);
+            }
+            else {
+                snprintf(name, sizeof(name), "read %zuMB", read_size / (1024 * 1024));
+            }
+            report(name, measure(run_read, path, c2c, size, cold, repeats), size, cold);
+        }
+        report("mmap", measure(run_mmap, path, c2c, size, cold, repeats), size, cold);
+        report("mmap MAP_POPULATE", measure(run_mmap_populate, path, c2c, size, cold, repeats), size, cold);
+        report("O_DIRECT 4MB", measure(run_direct, path, c2c, size, cold, repeats), size, cold);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE // clone, vfork
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Process creation benchmark for the 1.2 exercises (fork, wait, execv) and the
+// other ways the 1.4 dispatcher could start its workers.
+// Every variant creates a child that does nothing and waits for it, with the
+// parent holding more and more touched memory, so the page-table copy of fork
+// and the copy-on-write of the pages show up in the numbers.
+// Build: gcc -O2 -o spawn-bench spawn-bench.c
+// Usage: ./spawn-bench [max RSS MB] [runs] [program to exec]
+// The RSS goes 1 MB, 4 MB, ... up to the maximum (default 4096). Each cell runs
+// the given number of times (default 200), or fewer if it takes over
+// CELL_BUDGET seconds. The exec variants run /bin/true unless told otherwise.
+
+#define MIN_RSS_MB 1
+#define RSS_STEP 4 // Next RSS = RSS * 4
+#define CELL_BUDGET 2.0 // Seconds per variant and RSS, at least MIN_RUNS runs
+#define MIN_RUNS 5
+#define COW_MAX_MB 256 // The fork+write child dirties at most this much of the memory
+#define CLONE_STACK (64 * 1024)
+
+// One run: the minor faults of the child and of the parent
+typedef struct {
+    long child_faults; // Pages the child had to map or copy
+    long parent_faults;
+} Sample;
+
+typedef int (*Variant)(Sample *s);
+
+char *ballast; // The parent's memory, touched up to ballast_size
+size_t ballast_size;
+size_t cow_size; // Bytes the fork+write child writes
+const char *exec_path = "/bin/true";
+char *clone_stack;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long self_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+// Value of a "Key:   N kB" line of /proc/self/status, -1 if missing
+long status_kb(const char *key) {
+    char line[128];
+    long value = -1;
+    size_t len = strlen(key);
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, key, len) == 0 && line[len] == ':') {
+            sscanf(line + len + 1, "%ld", &value);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+// Wait for the child and take its faults from wait4
+int reap(pid_t pid, Sample *s) {
+    struct rusage ru;
+    int status;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4 failed");
+        return -1;
+    }
+    s->child_faults = ru.ru_minflt;
+    return 0;
+}
+
+// --- The variants, timed from before the call until the child is reaped ---
+
+int run_fork(Sample *s) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
+    return reap(pid, s);
+}
+
+// The child writes one byte in every page of the first cow_size bytes,
+// so every one of them is copied
+int run_fork_write(Sample *s) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < cow_size; off += page) {
+            ballast[off]++;
+        }
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
+    return reap(pid, s);
+}
+
+int run_vfork(Sample *s) {
+    pid_t pid = vfork();
+    if (pid == 0) {
+        _exit(0);
+    }
+    if (pid < 0) {
+        perror("vfork failed");
+        return -1;
+    }
+    return reap(pid, s);
+}
+
+int clone_child(void *arg) {
+    (void)arg;
+    return 0;
+}
+
+// Shares the memory like a thread, but is a process the parent waits for
+int run_clone_vm(Sample *s) {
+    pid_t pid = clone(clone_child, clone_stack + CLONE_STACK, CLONE_VM | SIGCHLD, NULL);
+    if (pid < 0) {
+        perror("clone failed");
+        return -1;
+    }
+    return reap(pid, s);
+}
+
+extern char **environ;
+
+int run_posix_spawn(Sample *s) {
+    pid_t pid;
+    char *args[] = { (char *)exec_path, NULL };
+    int err = posix_spawn(&pid, exec_path, NULL, NULL, args, environ);
+    if (err != 0) {
+        fprintf(stderr, "posix_spawn failed: %s\n", strerror(err));
+        return -1;
+    }
+    return reap(pid, s);
+}
+
+// As in 1.2.4.c
+int run_fork_exec(Sample *s) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *args[] = { (char *)exec_path, NULL };
+        execv(exec_path, args);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
+    return reap(pid, s);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Run one variant at the current RSS and print its line
+void measure(const char *name, Variant run, int runs) {
+    static double latencies[100000];
+    long child_faults = 0, parent_faults = 0;
+    int n = 0;
+    double start = now();
+    if (runs > 100000) {
+        runs = 100000;
+    }
+    while (n < runs && (n < MIN_RUNS || now() - start < CELL_BUDGET)) {
+        Sample s = { 0 };
+        long flt0 = self_faults();
+        double t0 = now();
+        if (run(&s) == -1) {
+            printf("  %-14s %8s\n", name, "n/a");
+            return;
+        }
+        latencies[n++] = now() - t0;
+        parent_faults += self_faults() - flt0;
+        child_faults += s.child_faults;
+    }
+    qsort(latencies, n, sizeof(double), compare_double);
+    printf("  %-14s %6d %10.1f %10.1f %10.1f %10.1f %12.1f %12.1f\n", name, n,
+           latencies[n / 2] * 1e6, latencies[(int)(n * 0.9)] * 1e6, latencies[(int)(n * 0.99)] * 1e6,
+           latencies[n - 1] * 1e6, (double)child_faults / n, (double)parent_faults / n);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 4) {
+        fprintf(stderr, "Usage: %s [max RSS MB] [runs] [program to exec]\n", argv[0]);
+        return 1;
+    }
+    long max_mb = (argc > 1) ? atol(argv[1]) : 4096;
+    int runs = (argc > 2) ? atoi(argv[2]) : 200;
+    if (argc > 3) {
+        exec_path = argv[3];
+    }
+    if (max_mb < MIN_RSS_MB || runs < 1) {
+        fprintf(stderr, "The RSS and the runs must be positive\n");
+        return 1;
+    }
+    if (access(exec_path, X_OK) == -1) {
+        perror(exec_path);
+        return 1;
+    }
+
+    // Reserve the whole range once, the levels only touch more of it
+    ballast = mmap(NULL, max_mb << 20, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    clone_stack = malloc(CLONE_STACK);
+    if (ballast == MAP_FAILED || clone_stack == NULL) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+
+    printf("Process creation latency (us), %d runs per cell or %.0fs, exec target %s\n",
+           runs, CELL_BUDGET, exec_path);
+    printf("Faults are minor page faults per run: the child's are the pages it mapped or copied\n");
+
+    struct {
+        const char *name;
+        Variant run;
+    } variants[] = {
+        { "fork+wait", run_fork },
+        { "fork+write", run_fork_write },
+        { "vfork", run_vfork },
+        { "clone(VM)", run_clone_vm },
+        { "posix_spawn", run_posix_spawn },
+        { "fork+execv", run_fork_exec },
+    };
+
+    for (long mb = MIN_RSS_MB; ; mb = (mb * RSS_STEP < max_mb) ? mb * RSS_STEP : max_mb) {
+        size_t size = mb << 20;
+        memset(ballast + ballast_size, 1, size - ballast_size); // Make it resident, and private
+        ballast_size = size;
+        cow_size = (mb < COW_MAX_MB) ? size : (size_t)COW_MAX_MB << 20;
+        printf("\nRSS %ld MB (VmRSS %ld KB, page tables %ld KB), fork+write dirties %zu MB\n",
+               mb, status_kb("VmRSS"), status_kb("VmPTE"), cow_size >> 20);
+        printf("  %-14s %6s %10s %10s %10s %10s %12s %12s\n", "variant", "runs", "p50", "p90", "p99", "max",
+               "child flt", "parent flt");
+        for (size_t k = 0; k < sizeof(variants) / sizeof(variants[0]); k++) {
+            measure(variants[k].name, variants[k].run, runs);
+        }
+        if (mb == max_mb) {
+            break; // The last level is the maximum itself
+        }
+    }
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // SEEK_DATA
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -6,29 +7,226 @@
 #include <stdio.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "../search.h"
 
-#define P 10
+#define P 10 // Children if the number of online CPUs is unknown
+#define MAX_CHILDREN 256
+#define CHUNK_SIZE (1024 * 1024) // Unit of work a child claims from the shared cursor
 
-int active_children = 0;
+volatile sig_atomic_t active_children = 0;
+
+// Result slot of one child, written only by that child while it scans
+// Each slot has its own cache line, so children publishing their progress
+// do not keep invalidating each other's lines (false sharing)
+typedef struct {
+    long count; // Matches so far
+    long bytes_scanned;
+    long chunks_done;
+    pid_t pid; // Set by the parent
+    int finished; // Set by the parent when the child is reaped
+} __attribute__((aligned(64))) ChildSlot;
+
+// Shared between the parent and all children (MAP_SHARED | MAP_ANONYMOUS)
+// Children take the next chunk with an atomic add on next_chunk, so a slow
+// child just takes fewer chunks instead of holding everyone back
+typedef struct {
+    long next_chunk; // Next unclaimed chunk
+    long nchunks;
+    long filesize;
+    int nchildren;
+    struct timespec started; // When the children were forked
+    ChildSlot slots[MAX_CHILDREN];
+} Shared;
+
+Shared *shared; // Read by the SIGINT handler
+
+// Async-signal-safe formatting for the handler: no printf, only write()
+// Append a string / a number right-aligned in width columns / a number with one decimal
+void append_str(char *buf, int *len, const char *s) {
+    while (*s != '\0') {
+        buf[(*len)++] = *s++;
+    }
+}
+
+void append_num(char *buf, int *len, long num, int width) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0);
+    while (width-- > n) {
+        buf[(*len)++] = ' ';
+    }
+    while (n > 0) {
+        buf[(*len)++] = digits[--n];
+    }
+}
+
+void append_tenths(char *buf, int *len, double value, int width) {
+    long tenths = (long)(value * 10 + 0.5);
+    append_num(buf, len, tenths / 10, width - 2);
+    buf[(*len)++] = '.';
+    buf[(*len)++] = '0' + tenths % 10;
+}
 
 // Signal handler Ctrl+C
+// Prints a table of every child's progress from the shared slots, without stopping anyone
 void handle_sigint(int sig) {
-    char msg[100];  // Buffer
-    int len = snprintf(msg, sizeof(msg), "\n[%d] children still searching...\n", active_children); // Bytes printed is returned
-    write(1, msg, len);
+    (void)sig;
+    char line[160];
+    int len = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now); // Async-signal-safe
+    double elapsed = (now.tv_sec - shared->started.tv_sec) + (now.tv_nsec - shared->started.tv_nsec) / 1e9;
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+
+    append_str(line, &len, "\n[");
+    append_num(line, &len, active_children, 0);
+    append_str(line, &len, "] children still searching...\n  child      pid   state       MB scanned  chunks    matches     MB/s\n");
+    write(1, line, len);
+
+    long total_bytes = 0;
+    long total_count = 0;
+    for (int i = 0; i < shared->nchildren; i++) {
+        ChildSlot *slot = &shared->slots[i];
+        long bytes = __atomic_load_n(&slot->bytes_scanned, __ATOMIC_RELAXED);
+        long count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+        total_bytes += bytes;
+        total_count += count;
+
+        len = 0;
+        append_num(line, &len, i, 7);
+        append_num(line, &len, slot->pid, 9);
+        append_str(line, &len, slot->finished ? "   done    " : "   running ");
+        append_tenths(line, &len, bytes / 1e6, 14);
+        append_num(line, &len, __atomic_load_n(&slot->chunks_done, __ATOMIC_RELAXED), 8);
+        append_num(line, &len, count, 11);
+        append_tenths(line, &len, bytes / 1e6 / elapsed, 9);
+        append_str(line, &len, "\n");
+        write(1, line, len);
+    }
+
+    // The ETA assumes the total rate stays the same for the rest of the file
+    double rate = total_bytes / elapsed;
+    len = 0;
+    append_str(line, &len, "  total: ");
+    append_tenths(line, &len, shared->filesize ? total_bytes * 100.0 / shared->filesize : 100.0, 0);
+    append_str(line, &len, "% of the file, ");
+    append_num(line, &len, total_count, 0);
+    append_str(line, &len, " matches, ");
+    append_tenths(line, &len, rate / 1e6, 0);
+    append_str(line, &len, " MB/s, ETA ");
+    if (rate > 0 && total_bytes <= shared->filesize) {
+        append_tenths(line, &len, (shared->filesize - total_bytes) / rate, 0);
+        append_str(line, &len, " s\n");
+    }
+    else {
+        append_str(line, &len, "unknown\n");
+    }
+    write(1, line, len);
 }
 
-// Count the number of times a character appears in a buffer
-int buf_counter(char *buffer, char c2c) {
-    int count = 0;
-    for (size_t i = 0; i < strlen(buffer); i++) {
-        if (buffer[i] == c2c) {
-            count++;
+
+
+// Count the matches that start in [start, start + length)
+// Reads needle_len - 1 bytes into the next chunk, so a match crossing the
+// chunk boundary is counted once, by the chunk where it starts
+// The matches and bytes are published in the child's slot after every read
+// Returns -1 on read error
+int scan_chunk(int fd1, off_t start, off_t length, off_t filesize, const char *needle, int needle_len, const ByteClass *bc, WcStats *wc, ChildSlot *slot) {
+    off_t window_end = start + length + needle_len - 1;
+    if (window_end > filesize) {
+        window_end = filesize;
+    }
+
+    // Sparse file: if the chunk and its overlap are all in a hole, every byte is
+    // '\0' and the result is known without reading (no data until window_end)
+    off_t data = lseek(fd1, start, SEEK_DATA);
+    if ((data == -1 && errno == ENXIO) || (data != -1 && data >= window_end)) {
+        if (wc != NULL) {
+            // '\0' neither starts nor ends a word: no word, one line without a newline
+            wc_init(wc);
+            wc->bytes = length;
+            wc->prefix_len = length;
+            wc->suffix_len = length;
+        }
+        else {
+            int zeros = (bc != NULL) ? bc->member[0] : 1; // A class counts '\0' bytes like a one-byte needle
+            for (int k = 0; bc == NULL && k < needle_len; k++) {
+                zeros &= (needle[k] == '\0');
+            }
+            // Every start in the chunk that leaves room for the needle before EOF
+            off_t last = filesize - needle_len;
+            off_t found = (last >= start) ? ((last < start + length - 1) ? last : start + length - 1) - start + 1 : 0;
+            if (zeros) {
+                __atomic_store_n(&slot->count, slot->count + found, __ATOMIC_RELAXED);
+            }
         }
+        __atomic_store_n(&slot->bytes_scanned, slot->bytes_scanned + length, __ATOMIC_RELAXED);
+        return 0;
     }
-    return count;
-}
 
+    // Move the file pointer to the start position
+    if (lseek(fd1, start, SEEK_SET) == -1) {
+        perror("lseek failed");
+        return -1;
+    }
+
+    char buffer[MAX_NEEDLE + 1024];
+    ssize_t rfile;
+    off_t to_read = length + needle_len - 1; // Total bytes to read for this chunk
+    if (start + to_read > filesize) {
+        to_read = filesize - start;
+    }
+    int keep = 0; // Tail of the previous read, a match may start there
+    if (wc != NULL) {
+        wc_init(wc);
+    }
+    off_t overlap = to_read - length; // Bytes past the chunk, not counted as scanned
+
+    while (to_read > 0) {
+        ssize_t bytes_to_read;
+        if (to_read > 1024) {
+            bytes_to_read = 1024;
+        } else {
+            bytes_to_read = to_read;
+        }
+        rfile = read(fd1, buffer + keep, bytes_to_read); // Read from file 
+        if (rfile == -1) {
+            perror("Problem reading characters\n");
+            return -1;
+        }
+        if (rfile == 0) {
+            break;
+        }
+        to_read -= rfile;
+        long scanned = (to_read >= overlap) ? rfile : rfile - (overlap - to_read);
+        if (scanned > 0) {
+            __atomic_store_n(&slot->bytes_scanned, slot->bytes_scanned + scanned, __ATOMIC_RELAXED);
+        }
+        if (wc != NULL) {
+            wc_update(wc, (unsigned char *)buffer, rfile);
+            continue;
+        }
+        int have = keep + rfile;
+        long found = (bc != NULL) ? class_counter(buffer, have, bc)
+                                  : substr_counter(buffer, have, needle, needle_len); // Count the matches that fit in the buffer
+        __atomic_store_n(&slot->count, slot->count + found, __ATOMIC_RELAXED);
+        keep = (have < needle_len - 1) ? have : needle_len - 1;
+        memmove(buffer, buffer + have - keep, keep);
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     // Check the arguments
@@ -36,15 +234,16 @@ int main(int argc, char *argv[]) {
         perror("wrong number of args\n");
         return 1;
     }
-    if (argv[2][1] != '\0') {
-        perror("Wrong character input");
+    char needle[MAX_NEEDLE];
+    int wc_mode = (strcmp(argv[2], "--wc") == 0); // wc-like line, word and byte statistics
+    static ByteClass byte_class; // "[0-9a-f]": count the bytes of a class in one pass
+    int class_mode = (parse_byte_class(argv[2], &byte_class) == 0); // "[" or "[i" stay ordinary strings
+    int needle_len = (wc_mode || class_mode) ? 1 : unescape_needle(argv[2], needle);
+    if (needle_len == -1) {
+        fprintf(stderr, "Wrong search string input: 1 to 256 bytes, \\xHH with two hex digits\n");
         return 2;
     }
 
-    int pipefd[2];
-    pipe(pipefd);  // pipe: pipefd[0] for read, pipefd[1] for write
-    signal(SIGINT, handle_sigint); // Ctrl+C -> Signal Handler Parent
-
     // Get file size
     struct stat st;
     int stat_result = stat(argv[1], &st);
@@ -53,11 +252,36 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     off_t filesize = st.st_size; // Get file size 
-    off_t chunk = filesize / P; // Calculate chunk size = filesize / number of children
+    long nchunks = (filesize + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
+    // One child per online CPU, but not more children than chunks
+    long nchildren = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nchildren < 1) {
+        nchildren = P;
+    }
+    if (nchildren > MAX_CHILDREN) {
+        nchildren = MAX_CHILDREN;
+    }
+    if (nchildren > nchunks) {
+        nchildren = (nchunks > 0) ? nchunks : 1;
+    }
 
+    // wc mode: the statistics of every chunk follow the Shared header, merged in file order
+    size_t shared_size = sizeof(Shared) + (wc_mode ? nchunks * sizeof(WcStats) : 0);
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap failed");
+        return 1;
+    }
+    shared->next_chunk = 0; // Anonymous memory is zeroed, the slots start at 0
+    shared->nchunks = nchunks;
+    shared->filesize = filesize;
+    shared->nchildren = nchildren;
+    WcStats *wc_chunks = (WcStats *)(shared + 1);
+    clock_gettime(CLOCK_MONOTONIC, &shared->started);
+    signal(SIGINT, handle_sigint); // Ctrl+C -> Signal Handler Parent, reads the shared slots
 
-    for (int i = 0; i < P; i++) {
+    for (int i = 0; i < nchildren; i++) {
         pid_t pid = fork();
 
         if (pid < 0) {
@@ -67,103 +291,105 @@ int main(int argc, char *argv[]) {
 
         else if (pid == 0) {
             // CHILD
-            close(pipefd[0]); // child doesn't read
-
+            signal(SIGINT, SIG_IGN); // Ctrl+C only asks the parent for a report
             int fd1 = open(argv[1], O_RDONLY); //open the input file
             if (fd1 == -1) {
                 perror("Problem opening input file");
                 _exit(1);
             }
 
-            off_t start = i * chunk; // Calculate start position for each child
-            off_t end;
-            // Last child takes the rest of the file
-            if (i == P - 1) {  
-                end = filesize;
-            } 
-            else {
-                end = start + chunk;
-            }
-            off_t length = end - start; // Calculate length for each child
-            if (length < 0) {
-                perror("Invalid length");
-                close(fd1);
-                _exit(1);
-            }
-
-            // Move the file pointer to the start position
-            off_t lseek_result = lseek(fd1, start, SEEK_SET);
-            // Check for lseek errors 
-            if (lseek_result == -1) {
-                perror("lseek failed");
-                close(fd1);
-                _exit(1);
-            }
-            
-
-            char buffer[1024];
-            char c2c = argv[2][0]; /* Character to search for (second parameter in command line) */
-            ssize_t rfile;
-            ssize_t to_read = length; // Total bytes to read for this child
-            int total_count = 0;
-
-            do {
-                ssize_t bytes_to_read;
-                if (to_read > sizeof(buffer)) {
-                    bytes_to_read = sizeof(buffer);
-                } else {
-                    bytes_to_read = to_read;
-                }
-                rfile = read(fd1, buffer, bytes_to_read); // Read from file 
-                if (rfile == -1) {
-                    perror("Problem reading characters\n");
+            // Claim chunks until the file is exhausted
+            long k;
+            while ((k = __atomic_fetch_add(&shared->next_chunk, 1, __ATOMIC_RELAXED)) < nchunks) {
+                off_t start = k * CHUNK_SIZE;
+                off_t length = (start + CHUNK_SIZE > filesize) ? filesize - start : CHUNK_SIZE;
+                if (scan_chunk(fd1, start, length, filesize, needle, needle_len, class_mode ? &byte_class : NULL,
+                               wc_mode ? &wc_chunks[k] : NULL, &shared->slots[i]) == -1) {
                     close(fd1);
-                    return 1;
-                }
-                buffer[rfile] = '\0';
-                total_count += buf_counter(buffer, c2c); // Count the number of times the character appears in the buffer
-                to_read -= rfile;
-                if (rfile == 0) {
-                    break;
+                    _exit(1);
                 }
+                __atomic_store_n(&shared->slots[i].chunks_done, shared->slots[i].chunks_done + 1, __ATOMIC_RELAXED);
             }
-            while (to_read > 0);
 
             close(fd1); // close the file for reading
-            write(pipefd[1], &total_count, sizeof(int));  // Write total_count to pipe
-            close(pipefd[1]);
             _exit(0);
         }
 
         else {
             // Parent keeps track of active children
+            shared->slots[i].pid = pid;
             active_children++;
         }
     }
 
     // PARENT continues
-    close(pipefd[1]);  // parent doesn't write
-
-    printf("Waiting... press Ctrl+C to test signal handling\n");
-    
-    // Δίνει 10 δευτερόλεπτα περιθώριο για Ctrl+C, χωρίς να τερματίσει το πρόγραμμα
-    // This is just to test the signal handler
-    for (int i = 0; i < 10; i++) {
-        sleep(1);
-    }  
-    
-    int total = 0;
-    int partial;
-    for (int i = 0; i < P; i++) {
-        read(pipefd[0], &partial, sizeof(int));  // Read total_count from pipe 
-        total += partial;  // Accumulate the partial counts
-        wait(NULL);
+    printf("Searching... press Ctrl+C for a progress report\n");
+    fflush(stdout);
+
+    // Reap the children as they finish
+    int failed = 0;
+    int status;
+    while (active_children > 0) {
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue; // Ctrl+C, the children are still running
+            }
+            perror("wait failed");
+            failed = 1;
+            break;
+        }
+        for (int i = 0; i < nchildren; i++) {
+            if (shared->slots[i].pid == pid) {
+                shared->slots[i].finished = 1;
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
         active_children--;  // Decrease active children after wait
     }
+    if (failed) {
+        fprintf(stderr, "A child failed, the result is incomplete\n");
+        return 1;
+    }
 
-    close(pipefd[0]);
-    printf("✅ Total count from all children: %d\n", total);
+    if (wc_mode) {
+        // Stitch the words and lines that cross chunk boundaries, in file order
+        long lines = 0, words = 0, bytes = 0, max_line = 0, open_line = 0;
+        int in_word = 0; // Inside a word at the end of the chunks so far
+        for (long k = 0; k < nchunks; k++) {
+            WcStats *c = &wc_chunks[k];
+            lines += c->lines;
+            words += c->words;
+            bytes += c->bytes;
+            if (in_word && c->starts_in_word) {
+                words--; // Same word as the end of the previous chunk
+            }
+            if (c->ends_in_word != -1) {
+                in_word = c->ends_in_word; // A chunk without spaces or word bytes passes it on
+            }
+            if (c->has_newline) {
+                if (open_line + c->prefix_len > max_line) max_line = open_line + c->prefix_len;
+                if (c->max_line > max_line) max_line = c->max_line;
+                open_line = c->suffix_len;
+            }
+            else {
+                open_line += c->bytes;
+            }
+        }
+        if (open_line > max_line) {
+            max_line = open_line;
+        }
+        printf("✅ Lines: %ld, words: %ld, bytes: %ld, max line length: %ld\n", lines, words, bytes, max_line);
+        return 0;
+    }
+
+    long total = 0;
+    for (int i = 0; i < nchildren; i++) {
+        total += shared->slots[i].count;  // Accumulate the partial counts
+    }
+    printf("✅ Total count from all %ld children: %ld\n", nchildren, total);
 
     return 0;
 }
-
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,10 +10,35 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <time.h>
+#include <zlib.h>
+#include "../search.h"
+#include "formats.h"
 
 #define MAX_WORKERS 100
-#define MAX_WORK_POOL 10000
 #define CHUNK_SIZE 4096
+#define RUN_CHUNKS 64 // Contiguous chunks reserved per worker (64 * 4KB = 256KB run)
+#define STANDBY_WORKERS 2 // Idle, initialized workers kept ready for add and restarts
+#define WARM_AHEAD (64 * 1024 * 1024) // Cold bytes prefetched while the cached chunks are counted
+#define MAX_GROUP_FANOUT 64 // Children of one sub-dispatcher, as in worker.c
+#define MAX_GROUP_LEAVES 4096 // Workers under one sub-dispatcher
+#define GROUP_CHUNKS_PER_LEAF 4 // Chunks per command to a sub-dispatcher, per worker under it
+#define PATTERN_LINE_MAX (24 * (MAX_PATTERNS + 1)) // Total and one count per pattern, 24 chars each
+#define OFFSETS_LINE_MAX (2 * CHUNK_SIZE + 48) // Counts and at most one " d" per byte of a chunk (one-digit deltas are the densest)
+#define RESULT_LINE_MAX (((PATTERN_LINE_MAX > OFFSETS_LINE_MAX) ? PATTERN_LINE_MAX : OFFSETS_LINE_MAX) + 1) // Longest result line of a worker, and its '\0'
+#define SAMPLE_STRATA 32 // Strata of the file in estimate mode
+#define SAMPLE_MIN 4 // Chunks per stratum before a confidence interval is given
+#define ESTIMATE_Z 1.96 // 95% confidence interval
+#define ESTIMATE_REPORT_SEC 1 // Running estimate sent at most once per second
+#define INDEX_DEFAULT_BLOCK_KB 64 // Granularity of the range index
+#define OFFSETS_WINDOW 2048 // Chunks handed out past the next one to write in offsets mode
+#define OFFSETS_BUFFER 65536 // Output buffer of the offsets
+#define GZ_SPAN (1024 * 1024) // Uncompressed bytes between access points of a gzip input
+#define GZ_CHUNK 65536 // Compressed bytes read at a time
 
 // Worker structure, PID, FD, alive status
 typedef struct {
@@ -21,69 +47,280 @@ typedef struct {
     int from_worker_fd;
     int alive;
     int assigned_chunks; // Track the work load of each worker
+    int run_next; // Next chunk of the worker's contiguous run
+    int run_end; // One past the last chunk of the run
+    int last_done; // Last chunk finished, the next run starts right after it
+    int inflight_head; // Chunks sent and not answered yet, in order (-1 = none)
+    int inflight_tail;
+    int group_fanout; // 0 = worker, else a sub-dispatcher ("worker --group F L")
+    int group_levels;
+    int batch_chunks; // Chunks sent in one command: 1, or enough for every worker of the group
+    char result_buf[RESULT_LINE_MAX]; // Partial result line read so far
+    int result_len;
+    int skip_line; // A result line did not fit: its rest is dropped up to the newline
+    double started; // When the process was started, for its throughput
+    long bytes_done; // Bytes of the chunks it finished
 } Worker;
 
-// Work structure, offset, length, assigned status, done status, assigned worker
+// Work structure, offset, length, assigned worker
+// Whether a chunk is done lives in the done_bits bitmap, and free chunks are
+// kept as ranges, so no scheduling step has to walk the whole pool
 typedef struct {
     long offset;
     int length;
-    int assigned;
-    int done;
-    int assigned_worker;
+    int assigned_worker; // -1 = not in flight
+    int next_inflight; // Next chunk in the in-flight list of the same worker
+    int batch; // Chunks sent with one command, on the first of them
 } Work;
 
+// Chunks of one stratum in estimate mode: how many are in the sample and the
+// sum and sum of squares of the counts of those already finished
+typedef struct {
+    long population;
+    long sampled;
+    double sum;
+    double sumsq;
+} Stratum;
+
+// Range of consecutive free chunks [start, end)
+typedef struct {
+    int start;
+    int end;
+    int cold; // Not in the page cache when the pool was built
+} Range;
+
 //Global variables
 // Worker array, work pool, total file size, total characters found, processed bytes
 Worker workers[MAX_WORKERS];
 int worker_count = 0;
-Work work_pool[MAX_WORK_POOL];
+Worker standby[STANDBY_WORKERS]; // Spawned but not given any work yet
+int standby_count = 0;
+pid_t zygote_pid = -1; // Forks initialized workers, -1 = spawn ./worker directly
+int zygote_fd = -1; // Unix socket to the zygote
+extern char **environ;
+Work *work_pool; // One entry per chunk, sized from the file
 int work_count = 0;
+unsigned long *done_bits; // Bit j set = chunk j is done
+Range *free_ranges; // Stack of free ranges, requeued work on top
+int free_range_count = 0;
+int *range_slot; // Index in free_ranges of the range starting at chunk j (-1 = none)
 
 off_t total_file_size = 0;
 off_t processed_bytes = 0;
 int total_characters_found = 0;
 const char *input_file;
 const char *character;
+int input_fd = -1; // Kept open for readahead hints
 int response_fd = -1; // για να γράφουμε την απάντηση του dispatcher
 
+// Pattern set mode ("@file"): the workers return one count per pattern
+int pattern_count = 0;
+char pattern_names[MAX_PATTERNS][256];
+long pattern_totals[MAX_PATTERNS];
+int pattern_zero_len[MAX_PATTERNS]; // Length of a pattern made only of '\0' bytes, else 0
+int pattern_duplicate_of[MAX_PATTERNS]; // Earlier line with the same pattern (-1 = none), left out of the total
+
+// UTF-8 mode ("U+XXXX"): the workers also return the code points and whether the chunk was valid
+int utf8_mode = 0;
+long total_codepoints = 0;
+int invalid_chunks = 0;
+long first_invalid_offset = -1;
+
+// Matches that start in each finished chunk, for the range index
+// -1 = counted with the chunk before it, in the result of a sub-dispatcher batch
+long *chunk_counts;
+
+// wc mode: statistics of every finished chunk, merged in file order on request
+int wc_mode = 0;
+WcStats *wc_chunks;
+
+// Sparse files: chunks that lie in a hole (with the overlap past them) are all
+// '\0' bytes, so they are never sent to a worker; their counts are computed here
+char needle[MAX_NEEDLE]; // Decoded search string of the plain substring mode
+int needle_len = -1;
+long utf8_target = -1; // Code point of the "U+XXXX" mode
+int class_mode = 0; // "[...]": the workers count the bytes of a byte class
+ByteClass byte_class;
+int hole_chunks = 0;
+off_t hole_bytes = 0;
+
+// Estimate mode ("estimate <tolerance%> [seconds]"): the free chunks are sent in a
+// random order, stratified over the file, and the total is estimated from
+// the finished ones. 0 = off, 1 = sampling, 2 = stopped early
+int sample_mode = 0;
+int *sample_order; // Free chunks at the start of the estimate, in the order they are sent
+int sample_len = 0;
+int sample_pos = 0;
+unsigned long *sample_bits; // Bit j set = chunk j is in the sample
+int sample_strata = 0;
+Stratum strata[SAMPLE_STRATA];
+long sample_base = 0; // Exact count of every chunk outside the sample
+double sample_tolerance = 0; // Relative half-width of the interval to stop at, 0 = never
+double sample_deadline = 0; // Time to stop at, 0 = no time budget
+double last_estimate_report = 0;
+
+// Cancellation: no chunks are handed out and the workers drop the ones in flight
+// The workers stay alive, so "resume" goes on without a restart
+int job_cancelled = 0;
+double job_deadline = 0; // Time to cancel at, 0 = no deadline
+
+// Offsets mode ("offsets <path>" before the first add): the workers also send the
+// offset of every match, as deltas from the one before, and they are written out
+// in file order. Chunks that finish ahead of the next one to write wait in a ring
+// of OFFSETS_WINDOW slots and no chunk past the window is handed out, so the
+// memory does not grow with the file
+int offsets_fd = -1; // -1 = off
+int offsets_next = 0; // Next chunk to write
+char *offsets_slots[OFFSETS_WINDOW]; // Delta lists of finished chunks, at j % OFFSETS_WINDOW
+long offsets_written = 0;
+char offsets_out[OFFSETS_BUFFER];
+int offsets_out_len = 0;
+
+// Rank mode ("rank" before the first add, byte class only): the workers also send
+// the count of every byte of the class, so "index" can store one cumulative column
+// per byte and a range count can take any subset of the class at query time
+int rank_mode = 0;
+int rank_width = 0; // Bytes in the class, one column each, in byte order
+long *rank_counts; // work_count x rank_width; a batch is counted in its first chunk
+
+// gzip input ("*.gz"): one chunk per access point, in uncompressed offsets
+// The index is memory-mapped, the dispatcher only reads the offsets
+// (the dispatcher and the worker are linked with zlib: gcc ... -lz)
+const GzIndexHeader *gz_index; // NULL for a plain file
+const GzPoint *gz_points;
+
+Throttle *throttle; // NULL = the memfd could not be made, no limit
+
 // Function Prototypes
 void spawn_worker(); // Δημιουργεί έναν worker
+void spawn_group(const char *args); // Δημιουργεί έναν sub-dispatcher με τους δικούς του workers
 void remove_worker(); // Αφαιρεί έναν worker
 void assign_work(); // Αναθέτει δουλειά στους workers
 void collect_one_result(int i); // Συλλέγει το αποτέλεσμα από έναν worker
 void check_dead_workers(); // Ελέγχει αν υπάρχουν νεκροί workers
-void show_pstree(pid_t p); // Εμφανίζει το δέντρο διεργασιών του dispatcher
+void show_status(); // Εμφανίζει την κατάσταση των workers από το /proc
 void make_nonblocking(int fd); // Κάνει ένα file descriptor μη μπλοκαρισμένο
 void handle_sigterm(int sig); // Χειριστής σήματος για SIGTERM
 void handle_sigusr1(int sig); // Χειριστής σήματος για SIGUSR1 - Progress
 void create_work_pool(); // Δημιουργεί το work pool
+void map_holes(); // Βρίσκει τις τρύπες του αρχείου και βάζει στο pool μόνο τα δεδομένα
+void order_by_residency(); // Βάζει πρώτα τα chunks που είναι ήδη στο page cache
 void spawn_worker_at(int index); // Δημιουργεί έναν worker σε συγκεκριμένο index
+int launch_worker(Worker *w); // Ξεκινά μια διεργασία worker (zygote ή posix_spawn)
+void start_zygote(); // Ξεκινά το zygote
+void fill_standby(); // Γεμίζει το pool με τους έτοιμους workers
+int next_chunk_for(int j); // Επόμενο chunk από το run του worker
+void load_patterns(const char *path); // Διαβάζει τα ονόματα των patterns
+void show_pattern_counts(); // Εμφανίζει τα αποτελέσματα ανά pattern
+void align_chunks_to_utf8(); // Μετακινεί τα όρια των chunks σε αρχή χαρακτήρα UTF-8
+void show_wc(); // Εμφανίζει τα στατιστικά γραμμών/λέξεων/bytes
+void release_worker_work(int i); // Απελευθερώνει τη δουλειά ενός worker
+int chunk_done(int j); // Αν το chunk j έχει τελειώσει (bitmap)
+void mark_chunk_done(int j); // Σημειώνει το chunk j ως τελειωμένο
+void push_free_range(int start, int end); // Προσθέτει ελεύθερο range στη στοίβα
+void start_estimate(const char *args); // Ξεκινά (ή αλλάζει) την εκτίμηση με δειγματοληψία
+void check_estimate(); // Στέλνει την εκτίμηση και σταματά όταν φτάσει την ακρίβεια
+void cancel_job(const char *reason); // Ακυρώνει τη δουλειά, οι workers μένουν ζωντανοί
+void write_index(const char *args); // Γράφει το index για μετρήσεις σε διαστήματα του αρχείου
+void start_rank(); // Ζητά από τους workers τη μέτρηση κάθε byte της κλάσης
+void flush_offsets(); // Γράφει με τη σειρά τις θέσεις των chunks που τελείωσαν
+void open_gz_index(struct stat *st); // Φορτώνει ή φτιάχνει το index ενός αρχείου .gz
+double now_seconds(); // Μονοτονικός χρόνος σε δευτερόλεπτα
+void create_throttle(); // Φτιάχνει το κοινό token bucket των workers
+void set_throttle(const char *args); // Αλλάζει το όριο ταχύτητας και την προτεραιότητα των workers
+
+// Function to read the state, CPU time (seconds) and resident memory (KB) of a process
+// from /proc/<pid>/stat and /proc/<pid>/statm; returns -1 if it is gone
+int read_proc_stats(pid_t pid, char *state, double *cpu, long *rss_kb) {
+    char path[64], buf[512];
+    unsigned long utime, stime;
+    long size, resident;
 
-// Function to show the process tree of the dispatcher
-void show_pstree(pid_t p) {
-    int ret;
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd), "echo; echo; pstree -a -G -c -p %ld; echo; echo", (long)p);
-    cmd[sizeof(cmd)-1] = '\0';
-    ret = system(cmd);
-    if (ret < 0) {
-        perror("system");
-        exit(104);
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    char *fields = strrchr(buf, ')'); // The command name may contain spaces
+    if (fields == NULL || sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                                 state, &utime, &stime) != 3) {
+        return -1;
+    }
+    *cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    fd = open(path, O_RDONLY);
+    *rss_kb = 0;
+    if (fd != -1) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n > 0) {
+            buf[n] = '\0';
+            if (sscanf(buf, "%ld %ld", &size, &resident) == 2) {
+                *rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+            }
+        }
     }
+    return 0;
+}
+
+// Function to show the status of every worker, built in-process from /proc
+// Only the known pids are read, two small files each, so the cost depends on
+// the number of workers and not on the file size
+void show_status() {
+    char buffer[512];
+    double now = now_seconds();
+    int len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] PID %d, %d workers, %d standby, zygote %d, %.2f%% done\n",
+                       getpid(), worker_count, standby_count, zygote_pid, (processed_bytes * 100.0) / total_file_size);
+    if (throttle != NULL && (throttle->rate > 0 || throttle->io_idle || throttle->nice != 0)) {
+        len--; // Before the newline
+        if (throttle->rate > 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", throttle %.1f MB/s", throttle->rate / (1024.0 * 1024));
+        }
+        len += snprintf(buffer + len, sizeof(buffer) - len, "%s", throttle->io_idle ? ", idle I/O" : "");
+        if (throttle->nice != 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", nice %d", throttle->nice);
+        }
+        len += snprintf(buffer + len, sizeof(buffer) - len, "\n");
+    }
+    write(response_fd, buffer, len);
 
-    fprintf(stderr, "=== Worker assignments ===\n");
     for (int i = 0; i < worker_count; i++) {
-        if (workers[i].alive) {
-            fprintf(stderr, "[WORKER %d] PID %d, assigned_chunks = %d\n", i, workers[i].pid, workers[i].assigned_chunks);
-            for (int j = 0; j < work_count; j++) {
-                if (work_pool[j].assigned_worker == i && work_pool[j].done == 0) {
-                    fprintf(stderr, "    - Chunk offset: %ld, length: %d\n",
-                        work_pool[j].offset, work_pool[j].length);
-                }
+        char state = '?';
+        double cpu = 0;
+        long rss_kb = 0;
+        if (!workers[i].alive || read_proc_stats(workers[i].pid, &state, &cpu, &rss_kb) == -1) {
+            len = snprintf(buffer, sizeof(buffer), "    [WORKER %d] PID %d, gone\n", i, workers[i].pid);
+            write(response_fd, buffer, len);
+            continue;
+        }
+        double elapsed = now - workers[i].started;
+        double mb_s = (elapsed > 0) ? workers[i].bytes_done / elapsed / (1024 * 1024) : 0;
+        len = snprintf(buffer, sizeof(buffer), "    [WORKER %d] PID %d, state %c, CPU %.2fs, RSS %ld KB, %.2f MB/s",
+                       i, workers[i].pid, state, cpu, rss_kb, mb_s);
+        if (workers[i].group_fanout > 0) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", sub-dispatcher %d^%d",
+                            workers[i].group_fanout, workers[i].group_levels);
+        }
+        int j = workers[i].inflight_head;
+        if (j != -1) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", chunk at %ld", work_pool[j].offset);
+            if (work_pool[j].batch > 1) {
+                len += snprintf(buffer + len, sizeof(buffer) - len, " (batch of %d)", work_pool[j].batch);
             }
         }
+        else {
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", idle");
+        }
+        len += snprintf(buffer + len, sizeof(buffer) - len, "\n");
+        write(response_fd, buffer, len);
     }
-    fprintf(stderr, "===========================\n");
 }
 
 // Quit handler
@@ -95,6 +332,14 @@ void handle_sigterm(int sig) {
             waitpid(workers[i].pid, NULL, 0);
         }
     }
+    for (int i = 0; i < standby_count; i++) {
+        kill(standby[i].pid, SIGTERM);
+        waitpid(standby[i].pid, NULL, 0);
+    }
+    if (zygote_pid != -1) {
+        kill(zygote_pid, SIGTERM);
+        waitpid(zygote_pid, NULL, 0);
+    }
     exit(0);
 }
 
@@ -104,6 +349,14 @@ void handle_sigusr1(int sig) {
     (void)sig;
     char buffer[256];
     int len = snprintf(buffer, sizeof(buffer),"[DISPATCHER] Progress: %.2f%%, Characters found so far: %d\n", (processed_bytes * 100.0) / total_file_size, total_characters_found);
+    if (utf8_mode) {
+        len--; // Continue the same line
+        len += snprintf(buffer + len, sizeof(buffer) - len, ", code points: %ld, invalid UTF-8 chunks: %d", total_codepoints, invalid_chunks);
+        if (first_invalid_offset != -1) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, " (first at byte %ld)", first_invalid_offset);
+        }
+        len += snprintf(buffer + len, sizeof(buffer) - len, "\n");
+    }
     if (response_fd != -1) {
         if (write(response_fd, buffer, len) == -1) {
             perror("[DISPATCHER] Failed to write progress");
@@ -127,57 +380,204 @@ void make_nonblocking(int fd) {
     }
 }
 
-// Function to spawn a worker process
-// It creates pipes for communication and forks a new process
-// The child process executes the worker program
-void spawn_worker_at(int index) {
+// Function to start the zygote: a worker in "--zygote" mode that has already
+// done its setup and forks ready workers on request (see worker.c)
+// Its workers are orphaned on purpose; as a child subreaper the dispatcher
+// adopts them, so waitpid() and the crash detection keep working
+void start_zygote() {
+    int sv[2];
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("[DISPATCHER] No zygote, workers are spawned directly");
+        return;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+    char *args[] = { "worker", (char *)input_file, (char *)character, "--zygote", NULL };
+    int err = posix_spawn(&zygote_pid, "./worker", &actions, NULL, args, environ); // Returns the error, errno is not set
+    if (err != 0) {
+        fprintf(stderr, "[DISPATCHER] No zygote, workers are spawned directly: %s\n", strerror(err));
+        zygote_pid = -1;
+        close(sv[0]);
+    }
+    else {
+        zygote_fd = sv[0];
+        fprintf(stderr, "[DISPATCHER] Zygote started (PID: %d)\n", zygote_pid);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+}
+
+// Function to ask the zygote for a worker on the given pipe ends
+// The pipe ends travel as SCM_RIGHTS, the zygote answers with the new pid
+// Returns -1 if the zygote failed
+pid_t zygote_fork(int worker_in, int worker_out) {
+    char byte = 'w';
+    int fds[2] = { worker_in, worker_out };
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    pid_t pid;
+    if (sendmsg(zygote_fd, &msg, 0) != 1 || read(zygote_fd, &pid, sizeof(pid)) != sizeof(pid)) {
+        return -1;
+    }
+    return pid;
+}
+
+// Function to start a worker process
+// It creates pipes for communication, and the worker comes from the zygote,
+// or from posix_spawn of ./worker if there is no zygote (vfork-style, the
+// dispatcher's page tables are not copied). A sub-dispatcher is always
+// spawned, with "--group F L", and forks its own workers.
+// Returns -1 on failure
+int launch_worker(Worker *w) {
     int to_worker[2];
     int from_worker[2];
 
-    if (pipe(to_worker) == -1 || pipe(from_worker) == -1) {
+    // Close-on-exec: no other worker inherits these pipe ends
+    if (pipe2(to_worker, O_CLOEXEC) == -1 || pipe2(from_worker, O_CLOEXEC) == -1) {
         perror("pipe creation failed");
         exit(1);
     }
 
-    pid_t pid = fork();
+    pid_t pid = -1;
+    if (zygote_fd != -1 && w->group_fanout == 0) {
+        pid = zygote_fork(to_worker[0], from_worker[1]);
+        if (pid == -1) {
+            fprintf(stderr, "[DISPATCHER] Zygote failed, spawning workers directly\n");
+            close(zygote_fd);
+            zygote_fd = -1;
+        }
+    }
     if (pid == -1) {
-        perror("fork failed");
-        exit(1);
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, to_worker[0], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, from_worker[1], STDOUT_FILENO);
+        char fanout[16], levels[16];
+        snprintf(fanout, sizeof(fanout), "%d", w->group_fanout);
+        snprintf(levels, sizeof(levels), "%d", w->group_levels);
+        char *args[] = { "worker", (char *)input_file, (char *)character, "--group", fanout, levels, NULL };
+        if (w->group_fanout == 0) {
+            args[3] = NULL; // Plain worker
+        }
+        int err = posix_spawn(&pid, "./worker", &actions, NULL, args, environ);
+        if (err != 0) {
+            fprintf(stderr, "[DISPATCHER] posix_spawn of ./worker failed: %s\n", strerror(err));
+            pid = -1;
+        }
+        posix_spawn_file_actions_destroy(&actions);
     }
 
-    if (pid == 0) {
-        dup2(to_worker[0], STDIN_FILENO);
-        dup2(from_worker[1], STDOUT_FILENO);
+    close(to_worker[0]);
+    close(from_worker[1]);
+    if (pid == -1) {
+        fprintf(stderr, "[DISPATCHER] Spawn worker failed\n"); // The cause is reported above
         close(to_worker[1]);
         close(from_worker[0]);
-        execl("./worker", "worker", input_file, character, NULL);
-        perror("exec worker failed");
+        return -1;
+    }
+    w->pid = pid;
+    // Pipes for communication
+    w->to_worker_fd = to_worker[1];
+    w->from_worker_fd = from_worker[0];
+    make_nonblocking(w->from_worker_fd);
+    return 0;
+}
+
+// Function to keep STANDBY_WORKERS idle workers ready
+void fill_standby() {
+    while (standby_count < STANDBY_WORKERS) {
+        if (launch_worker(&standby[standby_count]) == -1) {
+            return;
+        }
+        standby_count++;
+    }
+}
+
+// Function to put a worker at a specific index
+// An idle standby worker is used if there is one, so add and restarts do not wait for a spawn
+// A sub-dispatcher is restarted as a sub-dispatcher, with the same fan-out
+void spawn_worker_at(int index) {
+    if (standby_count > 0 && workers[index].group_fanout == 0) {
+        standby_count--;
+        workers[index].pid = standby[standby_count].pid;
+        workers[index].to_worker_fd = standby[standby_count].to_worker_fd;
+        workers[index].from_worker_fd = standby[standby_count].from_worker_fd;
+    }
+    else if (launch_worker(&workers[index]) == -1) {
         exit(1);
-    } 
-    else {
-        close(to_worker[0]);
-        close(from_worker[1]);
-        workers[index].pid = pid;
-        // Pipes for communication
-        workers[index].to_worker_fd = to_worker[1];
-        workers[index].from_worker_fd = from_worker[0];
-        workers[index].alive = 1; // Active worker
-        workers[index].assigned_chunks = 0; // Initialize assigned chunks
-        make_nonblocking(workers[index].from_worker_fd);
-        fprintf(stderr, "[DISPATCHER] New worker spawned (PID: %d)\n", pid);
     }
+    workers[index].alive = 1; // Active worker
+    workers[index].result_len = 0;
+    workers[index].skip_line = 0;
+    workers[index].started = now_seconds();
+    workers[index].bytes_done = 0;
+    fprintf(stderr, "[DISPATCHER] New worker spawned (PID: %d)\n", workers[index].pid);
 }
 
-// Function to spawn a worker process
-void spawn_worker() {
+// Function to add a worker, or a sub-dispatcher if fanout > 0
+void add_worker(int fanout, int levels, int batch_chunks) {
     if (worker_count >= MAX_WORKERS) {
         printf("[DISPATCHER] Maximum number of workers reached\n");
         return;
     }
+    workers[worker_count].group_fanout = fanout;
+    workers[worker_count].group_levels = levels;
+    workers[worker_count].batch_chunks = batch_chunks;
     spawn_worker_at(worker_count); // Also writes feedback
+    workers[worker_count].assigned_chunks = 0; // Initialize assigned chunks
+    workers[worker_count].inflight_head = -1;
+    workers[worker_count].inflight_tail = -1;
+    workers[worker_count].run_next = 0;
+    workers[worker_count].run_end = 0;
+    workers[worker_count].last_done = -1;
     worker_count++;
 }
 
+// Function to spawn a worker process
+void spawn_worker() {
+    add_worker(0, 0, 1);
+}
+
+// Function to add a sub-dispatcher with fanout^levels workers under it
+// To the dispatcher it is one more worker that takes a batch of chunks per
+// command and answers with their merged result, so the dispatcher only sees
+// one result line per batch however many workers are below
+void spawn_group(const char *args) {
+    int fanout, levels = 1;
+    if (sscanf(args, "%d %d", &fanout, &levels) < 1 || fanout < 1 || fanout > MAX_GROUP_FANOUT || levels < 1) {
+        fprintf(stderr, "[DISPATCHER] Usage: group <fan-out 1-%d> [levels]\n", MAX_GROUP_FANOUT);
+        return;
+    }
+    if (offsets_fd != -1) {
+        fprintf(stderr, "[DISPATCHER] Sub-dispatchers do not send offsets, use add\n");
+        return;
+    }
+    long leaves = 1;
+    for (int l = 0; l < levels; l++) {
+        leaves *= fanout;
+        if (leaves > MAX_GROUP_LEAVES) {
+            fprintf(stderr, "[DISPATCHER] At most %d workers under a sub-dispatcher\n", MAX_GROUP_LEAVES);
+            return;
+        }
+    }
+    add_worker(fanout, levels, leaves * GROUP_CHUNKS_PER_LEAF);
+}
+
 // Function to remove a worker process
 void remove_worker() {
     if (worker_count > 0) {
@@ -201,12 +601,7 @@ void remove_worker() {
         workers[i].alive = 0;
 
         // Make available the work assigned to this worker
-        for (int j = 0; j < work_count; j++) {
-            if (work_pool[j].assigned_worker == i && work_pool[j].done == 0) {
-                work_pool[j].assigned = 0;
-                work_pool[j].assigned_worker = -1;
-            }
-        }
+        release_worker_work(i);
 
         worker_count--;
         fprintf(stderr, "[DISPATCHER] Worker (PID: %d) removed\n", pid);
@@ -220,76 +615,534 @@ void remove_worker() {
 }
 
 // Function to create the work pool
-// It divides the total file size into chunks and assigns them to the work pool
+// It divides the total file size into chunks; map_holes() then makes them free ranges
 void create_work_pool() {
+    int chunks = (gz_index != NULL) ? gz_index->points : (total_file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    work_pool = malloc(sizeof(Work) * (chunks + 1));
+    done_bits = calloc(chunks / (8 * sizeof(unsigned long)) + 1, sizeof(unsigned long));
+    free_ranges = malloc(sizeof(Range) * (chunks + 1)); // Free ranges never overlap
+    range_slot = malloc(sizeof(int) * (chunks + 1));
+    chunk_counts = malloc(sizeof(long) * (chunks + 1));
+    if (!work_pool || !done_bits || !free_ranges || !range_slot || !chunk_counts) {
+        perror("[DISPATCHER] Work pool allocation failed");
+        exit(1);
+    }
+
+    if (gz_index != NULL) {
+        // A gzip input is split at its access points, each chunk is inflated from its own
+        for (int k = 0; k < chunks; k++) {
+            long end = (k + 1 < chunks) ? gz_points[k + 1].out : total_file_size;
+            work_pool[k].offset = gz_points[k].out;
+            work_pool[k].length = end - gz_points[k].out;
+            work_pool[k].assigned_worker = -1;
+            work_pool[k].next_inflight = -1;
+            work_pool[k].batch = 1;
+            range_slot[k] = -1;
+        }
+        work_count = chunks;
+        return;
+    }
     for (off_t offset = 0; offset < total_file_size; offset += CHUNK_SIZE) {
+        work_pool[work_count].offset = offset;
         if (offset + CHUNK_SIZE > total_file_size) {
-            work_pool[work_count].offset = offset;
             work_pool[work_count].length = total_file_size - offset;
-            work_pool[work_count].assigned = 0;
-            work_pool[work_count].done = 0;
-            work_pool[work_count].assigned_worker = -1;
-            work_count++;
         } 
         else {
-            work_pool[work_count].offset = offset;
             work_pool[work_count].length = CHUNK_SIZE;
-            work_pool[work_count].assigned = 0;
-            work_pool[work_count].done = 0;
-            work_pool[work_count].assigned_worker = -1;
-            work_count++;
         }
-        
+        work_pool[work_count].assigned_worker = -1;
+        work_pool[work_count].next_inflight = -1;
+        work_pool[work_count].batch = 1;
+        range_slot[work_count] = -1;
+        work_count++;
+    }
+}
+
+// Length of s if it is only '\0' bytes, else 0
+int zero_needle_len(const char *s, int n) {
+    for (int k = 0; k < n; k++) {
+        if (s[k] != '\0') {
+            return 0;
+        }
+    }
+    return n;
+}
+
+// Matches of n '\0' bytes that start in chunk j, when everything from the chunk
+// to MAX_NEEDLE bytes past it is zeros: every start that still fits before EOF
+long zero_matches(int j, int n) {
+    off_t last_start = total_file_size - n; // Last offset a match can start at
+    off_t end = work_pool[j].offset + work_pool[j].length - 1;
+    if (n <= 0 || last_start < work_pool[j].offset) {
+        return 0;
+    }
+    return ((end < last_start) ? end : last_start) - work_pool[j].offset + 1;
+}
+
+// Function to count a hole chunk without reading it, like a worker result
+void account_hole_chunk(int j) {
+    long length = work_pool[j].length;
+    long found = 0;
+    if (pattern_count > 0) {
+        for (int p = 0; p < pattern_count; p++) {
+            long matches = zero_matches(j, pattern_zero_len[p]);
+            pattern_totals[p] += matches;
+            if (pattern_duplicate_of[p] == -1) {
+                found += matches;
+            }
+        }
+    }
+    else if (wc_mode) {
+        // '\0' neither starts nor ends a word: no word, one open line
+        WcStats *wc = &wc_chunks[j];
+        wc_init(wc);
+        wc->bytes = length;
+        wc->prefix_len = length;
+        wc->suffix_len = length;
+    }
+    else if (utf8_mode) {
+        total_codepoints += length; // Valid ASCII, one U+0000 per byte
+        found = (utf8_target == 0) ? length : 0;
+    }
+    else if (class_mode) {
+        found = byte_class.member[0] ? length : 0;
+    }
+    else {
+        found = zero_matches(j, zero_needle_len(needle, needle_len));
+    }
+    total_characters_found += found;
+    chunk_counts[j] = found;
+    mark_chunk_done(j);
+    processed_bytes += length;
+    hole_chunks++;
+    hole_bytes += length;
+}
+
+// Function to find the data and hole extents with lseek(SEEK_DATA/SEEK_HOLE)
+// and put only the chunks that touch data in the pool, as free ranges
+// A chunk counts as a hole only if MAX_NEEDLE bytes past it are a hole too,
+// so the overlap a worker would read is zeros as well. Two lseeks per extent
+void map_holes() {
+    off_t data = 0, hole = 0; // Current data extent [data, hole)
+    int searchable = (wc_mode || utf8_mode || class_mode || pattern_count > 0 || needle_len > 0);
+    int run_start = 0;
+
+    if (!searchable || gz_index != NULL) {
+        push_free_range(0, work_count); // The worker will reject the search string, or holes of a .gz say nothing
+        return;
+    }
+    data = lseek(input_fd, 0, SEEK_DATA);
+    if (data == -1 && errno != ENXIO) {
+        push_free_range(0, work_count); // No SEEK_DATA here, everything is data
+        return;
+    }
+    if (data == -1) {
+        data = hole = total_file_size; // ENXIO: the whole file is a hole
+    }
+    else {
+        hole = lseek(input_fd, data, SEEK_HOLE);
+    }
+
+    for (int j = 0; j < work_count; j++) {
+        off_t start = work_pool[j].offset;
+        off_t end = start + work_pool[j].length + MAX_NEEDLE;
+        if (end > total_file_size) {
+            end = total_file_size;
+        }
+        // Move to the first data extent that does not end before the chunk
+        while (hole <= start && data < total_file_size) {
+            data = lseek(input_fd, hole, SEEK_DATA);
+            if (data == -1) {
+                data = hole = total_file_size; // No more data
+            }
+            else {
+                hole = lseek(input_fd, data, SEEK_HOLE);
+            }
+        }
+        if (data >= end) {
+            push_free_range(run_start, j);
+            account_hole_chunk(j);
+            run_start = j + 1;
+        }
+    }
+    push_free_range(run_start, work_count);
+
+    if (hole_chunks > 0) {
+        fprintf(stderr, "[DISPATCHER] Sparse file: %d chunks (%ld bytes) are holes, counted without reading\n",
+                hole_chunks, (long)hole_bytes);
+    }
+}
+
+// Function to move every chunk boundary back onto the lead byte of a UTF-8 sequence
+// (at most 3 bytes), so no worker gets half of a multi-byte character
+void align_chunks_to_utf8() {
+    for (int k = 1; k < work_count; k++) {
+        unsigned char b[4];
+        long boundary = work_pool[k].offset;
+        if (pread(input_fd, b, 4, boundary - 3) != 4) {
+            continue;
+        }
+        int back = 0;
+        while (back < 3 && (b[3 - back] & 0xC0) == 0x80) {
+            back++;
+        }
+        if ((b[3 - back] & 0xC0) == 0x80) {
+            back = 0; // Invalid anyway, the worker will report it
+        }
+        work_pool[k - 1].length -= back;
+        work_pool[k].offset -= back;
+        work_pool[k].length += back;
+    }
+}
+
+int chunk_done(int j) {
+    return (done_bits[j / (8 * sizeof(unsigned long))] >> (j % (8 * sizeof(unsigned long)))) & 1;
+}
+
+void mark_chunk_done(int j) {
+    done_bits[j / (8 * sizeof(unsigned long))] |= 1UL << (j % (8 * sizeof(unsigned long)));
+}
+
+// Function to add the free range [start, end) on top of the stack
+void push_free_range(int start, int end) {
+    if (start >= end) {
+        return;
+    }
+    free_ranges[free_range_count].start = start;
+    free_ranges[free_range_count].end = end;
+    free_ranges[free_range_count].cold = 0;
+    range_slot[start] = free_range_count;
+    free_range_count++;
+}
+
+// Function to take up to max chunks from the front of free range r
+// The rest of the range stays free; an emptied range is replaced by the top one
+void take_from_range(int r, int max, int *start, int *end) {
+    Range *range = &free_ranges[r];
+    *start = range->start;
+    *end = (range->end - range->start > max) ? range->start + max : range->end;
+    range_slot[*start] = -1;
+    if (*end < range->end) {
+        range->start = *end;
+        range_slot[*end] = r;
+    }
+    else {
+        free_range_count--;
+        if (r != free_range_count) {
+            free_ranges[r] = free_ranges[free_range_count];
+            range_slot[free_ranges[r].start] = r;
+        }
+    }
+}
+
+// Function to release the work of a removed or dead worker
+// In-flight chunks and the rest of its run go back to the pool as free ranges
+void release_worker_work(int i) {
+    for (int j = workers[i].inflight_head; j != -1; j = work_pool[j].next_inflight) {
+        work_pool[j].assigned_worker = -1;
+        if (j == workers[i].run_next - 1) {
+            workers[i].run_next = j; // Usually the chunk just before the rest of the run
+        }
+        else {
+            push_free_range(j, j + 1);
+        }
+    }
+    push_free_range(workers[i].run_next, workers[i].run_end);
+    workers[i].inflight_head = -1;
+    workers[i].inflight_tail = -1;
+    workers[i].assigned_chunks = 0;
+    workers[i].run_next = 0;
+    workers[i].run_end = 0;
+}
+
+// Function to reserve a new contiguous run of chunks for worker j
+// Prefers the free range right after the last chunk the worker finished, so
+// the worker keeps reading sequentially, then the top of the free stack.
+// A cold range is not taken for being adjacent while cached ones are left.
+// When nothing is free it steals the back half of the largest run of another
+// worker (the only step that is not O(1), it walks the workers, not the chunks)
+// Returns 0 if there is no work left to reserve
+int reserve_run(int j) {
+    int prev = workers[j].last_done + 1;
+    int max = (workers[j].batch_chunks > RUN_CHUNKS) ? workers[j].batch_chunks : RUN_CHUNKS;
+
+    if (prev > 0 && prev < work_count && range_slot[prev] != -1 &&
+        !(free_ranges[range_slot[prev]].cold && !free_ranges[free_range_count - 1].cold)) {
+        take_from_range(range_slot[prev], max, &workers[j].run_next, &workers[j].run_end);
+    }
+    else if (free_range_count > 0) {
+        take_from_range(free_range_count - 1, max, &workers[j].run_next, &workers[j].run_end);
+    }
+    else {
+        // Steal the back half of the largest remaining run
+        int victim = -1;
+        int victim_left = 1;
+        for (int k = 0; k < worker_count; k++) {
+            if (k != j && workers[k].alive && workers[k].run_end - workers[k].run_next > victim_left) {
+                victim = k;
+                victim_left = workers[k].run_end - workers[k].run_next;
+            }
+        }
+        if (victim == -1) {
+            return 0;
+        }
+        int start = workers[victim].run_end - victim_left / 2;
+        workers[j].run_next = start;
+        workers[j].run_end = workers[victim].run_end;
+        workers[victim].run_end = start;
+    }
+
+    // Tell the kernel to read the whole run ahead, the worker reads it in order
+    // (for a gzip input, the compressed bytes between the access points)
+    // Not under a rate limit: the readahead would go to the disk at full speed
+    if (throttle != NULL && throttle->rate > 0) {
+        return 1;
+    }
+    if (input_fd != -1 && gz_index != NULL) {
+        off_t run_offset = gz_points[workers[j].run_next].in;
+        off_t run_end = (workers[j].run_end < gz_index->points) ? gz_points[workers[j].run_end].in : gz_index->compressed_size;
+        posix_fadvise(input_fd, run_offset, run_end - run_offset, POSIX_FADV_WILLNEED);
+    }
+    else if (input_fd != -1) {
+        off_t run_offset = work_pool[workers[j].run_next].offset;
+        off_t run_length = work_pool[workers[j].run_end - 1].offset + work_pool[workers[j].run_end - 1].length - run_offset;
+        posix_fadvise(input_fd, run_offset, run_length, POSIX_FADV_WILLNEED);
+    }
+    return 1;
+}
+
+// Function to find the next chunk for worker j in offsets mode
+// Only chunks inside the reorder window are handed out. A run that reaches past
+// it goes back to the pool and the worker takes the lowest free range instead,
+// so the next chunk to write is always in reach of a free worker
+// Returns -1 if there is no work inside the window
+int next_chunk_in_window(int j) {
+    int limit = offsets_next + OFFSETS_WINDOW;
+    if (workers[j].run_next < workers[j].run_end) {
+        if (workers[j].run_next < limit) {
+            return workers[j].run_next++;
+        }
+        push_free_range(workers[j].run_next, workers[j].run_end);
+        workers[j].run_next = workers[j].run_end = 0;
+    }
+    int lowest = -1;
+    for (int r = 0; r < free_range_count; r++) {
+        if (lowest == -1 || free_ranges[r].start < free_ranges[lowest].start) {
+            lowest = r;
+        }
+    }
+    if (lowest == -1 || free_ranges[lowest].start >= limit) {
+        return -1;
+    }
+    take_from_range(lowest, RUN_CHUNKS, &workers[j].run_next, &workers[j].run_end);
+    return workers[j].run_next++;
+}
+
+// Function to find the next chunk for worker j
+// It continues the worker's current run, or reserves a new one
+// Returns -1 if there is no work left
+int next_chunk_for(int j) {
+    if (job_cancelled || sample_mode == 2) {
+        return -1; // Cancelled, or the estimate stopped: wait for "resume" or "estimate 0"
+    }
+    if (offsets_fd != -1) {
+        return next_chunk_in_window(j);
+    }
+    while (1) {
+        if (workers[j].run_next < workers[j].run_end) {
+            return workers[j].run_next++; // The run belongs to this worker only
+        }
+        // In estimate mode requeued work (free ranges) goes first, then the sample order
+        if (sample_mode == 1 && free_range_count == 0 && sample_pos < sample_len) {
+            return sample_order[sample_pos++];
+        }
+        if (!reserve_run(j)) {
+            return -1;
+        }
     }
 }
 
 // Function to assign work to workers
-// It checks for unassigned work and assigns it to available workers
+// Each free worker gets the next chunk of its own contiguous run
 void assign_work() {
     for (int j = 0; j < worker_count; j++) {
         if (!workers[j].alive) continue; // Only alive workers
 
         if (workers[j].assigned_chunks == 0) { // Free worker
-            // Find next unassigned work
-            for (int i = 0; i < work_count; i++) {
-                if (work_pool[i].assigned == 0 && work_pool[i].done == 0) {
-                    // Assign this work to the free worker
-                    char msg[128];
-                    snprintf(msg, sizeof(msg), "%ld %d\n", work_pool[i].offset, work_pool[i].length);
-                    write(workers[j].to_worker_fd, msg, strlen(msg));
-                    
-                    work_pool[i].assigned = 1;
-                    work_pool[i].assigned_worker = j;
-                    workers[j].assigned_chunks++;
-
-                    break; // assign one job at a time to each free worker
+            int i = next_chunk_for(j);
+            if (i == -1) {
+                continue; // No work left
+            }
+            // A sub-dispatcher gets the following chunks of the run too, in one command
+            // (not while estimating: every sample chunk needs its own count)
+            int batch = 1;
+            long length = work_pool[i].length;
+            while (batch < workers[j].batch_chunks && sample_mode == 0 && workers[j].run_next < workers[j].run_end) {
+                length += work_pool[workers[j].run_next++].length;
+                batch++;
+            }
+
+            // Assign this work to the free worker
+            char msg[128];
+            snprintf(msg, sizeof(msg), (offsets_fd != -1) ? "%ld %ld 1\n" : rank_mode ? "%ld %ld 2\n" : "%ld %ld\n",
+                     work_pool[i].offset, length);
+            write(workers[j].to_worker_fd, msg, strlen(msg));
+
+            // Append to the worker's in-flight list, results come back in the same order
+            work_pool[i].batch = batch;
+            for (int c = i; c < i + batch; c++) {
+                work_pool[c].assigned_worker = j;
+                work_pool[c].next_inflight = -1;
+                if (workers[j].inflight_tail == -1) {
+                    workers[j].inflight_head = c;
+                }
+                else {
+                    work_pool[workers[j].inflight_tail].next_inflight = c;
                 }
+                workers[j].inflight_tail = c;
             }
+            workers[j].assigned_chunks++;
         }
     }
 }
 
 
+// Function to handle one complete result line of worker i
+// The line is the total, followed by one count per pattern in pattern mode
+void handle_result_line(int i, char *line) {
+    char *next;
+    int found = strtol(line, &next, 10);
+    total_characters_found += found;
+
+    for (int p = 0; p < pattern_count; p++) {
+        pattern_totals[p] += strtol(next, &next, 10);
+    }
+    long codepoints = 0;
+    int invalid = 0;
+    if (utf8_mode) {
+        codepoints = strtol(next, &next, 10);
+        invalid = strtol(next, &next, 10);
+    }
+    WcStats wc = { .lines = found };
+    if (wc_mode) {
+        wc.words = strtol(next, &next, 10);
+        wc.bytes = strtol(next, &next, 10);
+        wc.starts_in_word = strtol(next, &next, 10);
+        wc.ends_in_word = strtol(next, &next, 10);
+        wc.prefix_len = strtol(next, &next, 10);
+        wc.suffix_len = strtol(next, &next, 10);
+        wc.max_line = strtol(next, &next, 10);
+        wc.has_newline = strtol(next, &next, 10);
+    }
+
+    // The result is for the oldest command in flight on this worker: one chunk,
+    // or a batch of consecutive chunks for a sub-dispatcher
+    int j = workers[i].inflight_head;
+    if (j == -1) {
+        fprintf(stderr, "[DISPATCHER] Result without a chunk in flight, ignored\n");
+        return;
+    }
+    int batch = work_pool[j].batch;
+    for (int c = j; c < j + batch; c++) {
+        workers[i].inflight_head = work_pool[c].next_inflight;
+        work_pool[c].assigned_worker = -1;
+    }
+    if (workers[i].inflight_head == -1) {
+        workers[i].inflight_tail = -1;
+    }
+    work_pool[j].batch = 1;
+    workers[i].assigned_chunks--;
+
+    // Abandoned after a cancel: the chunks go back to the pool for "resume"
+    if (strncmp(line, "cancelled", 9) == 0) {
+        push_free_range(j, j + batch);
+        return;
+    }
+
+    if (sample_mode) {
+        if ((sample_bits[j / (8 * sizeof(unsigned long))] >> (j % (8 * sizeof(unsigned long)))) & 1) {
+            Stratum *st = &strata[(long)j * sample_strata / work_count];
+            st->sampled++;
+            st->sum += found;
+            st->sumsq += (double)found * found;
+        }
+        else {
+            sample_base += found;
+        }
+    }
+
+    if (offsets_fd != -1) {
+        // Only single chunks in offsets mode; the rest of the line is the delta list
+        offsets_slots[j % OFFSETS_WINDOW] = strdup(next);
+    }
+
+    total_codepoints += codepoints;
+    if (invalid) {
+        invalid_chunks++;
+        if (first_invalid_offset == -1 || work_pool[j].offset < first_invalid_offset) {
+            first_invalid_offset = work_pool[j].offset;
+        }
+    }
+    for (int c = j; c < j + batch; c++) {
+        if (wc_mode) {
+            // The merged statistics of a batch go to its first chunk, the rest stay empty
+            if (c == j) {
+                wc_chunks[c] = wc;
+            }
+            else {
+                memset(&wc_chunks[c], 0, sizeof(WcStats));
+            }
+        }
+        for (int m = 0; rank_mode && m < rank_width; m++) {
+            rank_counts[(long)c * rank_width + m] = (c == j) ? strtol(next, &next, 10) : 0;
+        }
+        chunk_counts[c] = (c == j) ? found : -1;
+        mark_chunk_done(c);
+        processed_bytes += work_pool[c].length;
+        workers[i].bytes_done += work_pool[c].length;
+    }
+    workers[i].last_done = j + batch - 1;
+    if (offsets_fd != -1) {
+        flush_offsets();
+    }
+}
+
 // Function to collect results from a specific worker
+// Long result lines may arrive in pieces, so they are buffered until the newline
 void collect_one_result(int i) {
-    char buffer[128];
-    ssize_t n = read(workers[i].from_worker_fd, buffer, sizeof(buffer) - 1);
+    Worker *w = &workers[i];
+    ssize_t n = read(w->from_worker_fd, w->result_buf + w->result_len, sizeof(w->result_buf) - 1 - w->result_len);
+    if (n > 0 && w->skip_line) {
+        // Still inside a line that was dropped, the next result starts after its newline
+        char *start = w->result_buf + w->result_len;
+        char *end = memchr(start, '\n', n);
+        if (end == NULL) {
+            return;
+        }
+        w->skip_line = 0;
+        n -= end + 1 - start;
+        if (n == 0) {
+            return;
+        }
+        memmove(start, end + 1, n);
+    }
     if (n > 0) {
-        buffer[n] = '\0';
-        // Check if the last character is a newline
-        // This indicates that I collect only full results
-        if (buffer[n-1] == '\n') {  
-            int found = atoi(buffer);
-            total_characters_found += found;
-
-            for (int j = 0; j < work_count; j++) {
-                if (work_pool[j].assigned_worker == i && work_pool[j].done == 0) {
-                    work_pool[j].done = 1;
-                    processed_bytes += work_pool[j].length;
-                    workers[i].assigned_chunks--;
-                    break;
-                }
-            }
+        w->result_len += n;
+        w->result_buf[w->result_len] = '\0';
+        // Handle every full result, keep the rest for the next read
+        char *line = w->result_buf;
+        char *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            handle_result_line(i, line);
+            line = newline + 1;
+        }
+        w->result_len -= line - w->result_buf;
+        memmove(w->result_buf, line, w->result_len);
+        if (w->result_len == (int)sizeof(w->result_buf) - 1) {
+            fprintf(stderr, "[DISPATCHER] Result line too long, dropped\n");
+            w->result_len = 0;
+            w->skip_line = 1;
         }
     }
     else if (n == 0) {
@@ -303,24 +1156,877 @@ void collect_one_result(int i) {
     }
 }
 
+// Function to read the pattern names of a "@file" search
+// read_pattern_set is what the worker uses too: a file it would reject is
+// rejected here, before any worker is started for it
+void load_patterns(const char *path) {
+    static PatternSet set;
+    if (read_pattern_set(path, &set) == -1) {
+        fprintf(stderr, "[DISPATCHER] Pattern file %s: %s\n", path, set.error);
+        exit(1);
+    }
+    pattern_count = set.count;
+    for (int p = 0; p < pattern_count; p++) {
+        memcpy(pattern_names[p], set.name[p], sizeof(pattern_names[p]));
+        pattern_totals[p] = 0;
+        pattern_zero_len[p] = zero_needle_len(set.text[p], set.len[p]);
+        pattern_duplicate_of[p] = set.duplicate_of[p];
+    }
+}
+
+// Function to send the wc statistics to the frontend
+// Chunks are merged in file order: a word that runs across a chunk boundary
+// was counted by both chunks, and a line across boundaries is the suffix of one
+// chunk, any chunks without a newline, and the prefix of the next one
+void show_wc() {
+    char buffer[256];
+    long lines = 0, words = 0, bytes = 0, max_line = 0;
+    long open_line = 0; // Length of the line still open at the current chunk
+    int prev_done = 0;
+    int prev_ends_in_word = 0;
+
+    if (!wc_mode) {
+        fprintf(stderr, "[DISPATCHER] Not in wc mode\n");
+        return;
+    }
+    for (int j = 0; j < work_count; j++) {
+        if (!chunk_done(j)) {
+            prev_done = 0;
+            prev_ends_in_word = 0;
+            open_line = 0;
+            continue;
+        }
+        WcStats *c = &wc_chunks[j];
+        if (c->bytes == 0) {
+            continue; // Merged into the first chunk of its batch
+        }
+        lines += c->lines;
+        bytes += c->bytes;
+        words += c->words;
+        if (prev_done && prev_ends_in_word == 1 && c->starts_in_word) {
+            words--; // Same word as the end of the previous chunk
+        }
+        if (c->has_newline) {
+            if (open_line + c->prefix_len > max_line) max_line = open_line + c->prefix_len;
+            if (c->max_line > max_line) max_line = c->max_line;
+            open_line = c->suffix_len;
+        }
+        else {
+            open_line += c->bytes;
+        }
+        prev_done = 1;
+        if (c->ends_in_word != -1) {
+            prev_ends_in_word = c->ends_in_word; // A chunk without spaces or word bytes passes it on
+        }
+    }
+    if (open_line > max_line) {
+        max_line = open_line;
+    }
+
+    int len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] wc (%.2f%% done): lines %ld, words %ld, bytes %ld, max line length %ld\n",
+                       (processed_bytes * 100.0) / total_file_size, lines, words, bytes, max_line);
+    write(response_fd, buffer, len);
+}
+
+// Function to send the totals of every pattern to the frontend
+void show_pattern_counts() {
+    char buffer[512];
+    if (pattern_count == 0) {
+        fprintf(stderr, "[DISPATCHER] Not searching for a pattern set\n");
+        return;
+    }
+    int len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] Pattern counts (%.2f%% done):\n", (processed_bytes * 100.0) / total_file_size);
+    write(response_fd, buffer, len);
+    for (int p = 0; p < pattern_count; p++) {
+        if (pattern_duplicate_of[p] != -1) {
+            len = snprintf(buffer, sizeof(buffer), "    %-32s %ld (same as pattern %d, counted once in the total)\n",
+                           pattern_names[p], pattern_totals[p], pattern_duplicate_of[p] + 1);
+        }
+        else {
+            len = snprintf(buffer, sizeof(buffer), "    %-32s %ld\n", pattern_names[p], pattern_totals[p]);
+        }
+        write(response_fd, buffer, len);
+    }
+}
+
+// Function to write the range index of the finished job ("index <path> [block KB]")
+// Per-block cumulative counts from the per-chunk counts, so a range count
+// later costs two lookups and a scan of at most one block at each end
+// (rangecount.c). Only for the plain substring and byte class modes, where
+// chunk j starts at j * CHUNK_SIZE and its count is the matches that start in it.
+// After "rank" there is one column per byte of the class instead of one in all
+void write_index(const char *args) {
+    char path[256], buffer[256];
+    long block_kb = INDEX_DEFAULT_BLOCK_KB;
+    if (sscanf(args, "%255s %ld", path, &block_kb) < 1 || block_kb <= 0 || (block_kb * 1024) % CHUNK_SIZE != 0) {
+        fprintf(stderr, "[DISPATCHER] Usage: index <path> [block KB, a multiple of %d]\n", CHUNK_SIZE / 1024);
+        return;
+    }
+    if ((needle_len <= 0 && !class_mode) || gz_index != NULL) {
+        fprintf(stderr, "[DISPATCHER] The range index needs a plain search string or a byte class, and a plain file\n");
+        return;
+    }
+    if (class_mode && strlen(character) >= MAX_NEEDLE) {
+        fprintf(stderr, "[DISPATCHER] The byte class is too long for the range index (at most %d characters)\n", MAX_NEEDLE - 1);
+        return;
+    }
+    if (processed_bytes < total_file_size) {
+        fprintf(stderr, "[DISPATCHER] The range index needs the whole file counted (%.2f%% done)\n",
+                (processed_bytes * 100.0) / total_file_size);
+        return;
+    }
+
+    IndexHeader header;
+    struct stat st;
+    memset(&header, 0, sizeof(header));
+    if (fstat(input_fd, &st) == -1) {
+        perror("[DISPATCHER] fstat failed");
+        return;
+    }
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.file_size = total_file_size;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.block_size = block_kb * 1024;
+    header.blocks = (total_file_size + header.block_size - 1) / header.block_size;
+    header.columns = rank_mode ? rank_width : 1;
+    if (class_mode) {
+        header.is_class = 1;
+        header.needle_len = strlen(character);
+        memcpy(header.needle, character, header.needle_len); // Parsed again by the reader
+    }
+    else {
+        header.needle_len = needle_len;
+        memcpy(header.needle, needle, needle_len);
+    }
+
+    int columns = header.columns;
+    long *cumulative = malloc(sizeof(long) * (header.blocks + 1) * columns);
+    long *sum = calloc(columns, sizeof(long));
+    if (cumulative == NULL || sum == NULL) {
+        perror("[DISPATCHER] Index allocation failed");
+        free(cumulative);
+        free(sum);
+        return;
+    }
+    int per_block = header.block_size / CHUNK_SIZE;
+    for (long k = 0; k <= header.blocks; k++) {
+        memcpy(&cumulative[k * columns], sum, sizeof(long) * columns);
+        for (int j = k * per_block; j < (k + 1) * per_block && j < work_count; j++) {
+            if (chunk_counts[j] == -1 && j == k * per_block) {
+                // A sub-dispatcher batch crosses the block boundary, its count cannot be split
+                fprintf(stderr, "[DISPATCHER] A batch crosses offset %ld, use workers or a larger block for the index\n",
+                        work_pool[j].offset);
+                free(cumulative);
+                free(sum);
+                return;
+            }
+            if (rank_mode) {
+                for (int m = 0; m < columns; m++) {
+                    sum[m] += rank_counts[(long)j * columns + m];
+                }
+            }
+            else if (chunk_counts[j] > 0) {
+                sum[0] += chunk_counts[j];
+            }
+        }
+    }
+    free(sum);
+
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("[DISPATCHER] Failed to create the index");
+        free(cumulative);
+        return;
+    }
+    size_t bytes = sizeof(long) * (header.blocks + 1) * columns;
+    if (write(fd, &header, sizeof(header)) != sizeof(header) || write(fd, cumulative, bytes) != (ssize_t)bytes) {
+        perror("[DISPATCHER] Failed to write the index");
+        close(fd);
+        unlink(path);
+        free(cumulative);
+        return;
+    }
+    close(fd);
+    free(cumulative);
+    int len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] Index of %ld blocks of %ld KB, %d column(s), written to %s\n",
+                       header.blocks, block_kb, columns, path);
+    write(response_fd, buffer, len);
+}
+
+// Function to add one offset to the output buffer, written when full
+void emit_offset(long offset) {
+    if (offsets_out_len > OFFSETS_BUFFER - 24) {
+        if (write(offsets_fd, offsets_out, offsets_out_len) != offsets_out_len) {
+            perror("[DISPATCHER] Failed to write offsets");
+        }
+        offsets_out_len = 0;
+    }
+    offsets_out_len += snprintf(offsets_out + offsets_out_len, 24, "%ld\n", offset);
+    offsets_written++;
+}
+
+// Function to write the offsets of every finished chunk at the head of the file
+// order, decoding the deltas of the workers. A hole chunk has no list: its
+// matches are every start the dispatcher counted in it, one after the other
+void flush_offsets() {
+    char buffer[256];
+    while (offsets_next < work_count && chunk_done(offsets_next)) {
+        int j = offsets_next;
+        char *slot = offsets_slots[j % OFFSETS_WINDOW];
+        if (slot != NULL) {
+            long offset = work_pool[j].offset;
+            char *p = slot, *end;
+            while (1) {
+                long delta = strtol(p, &end, 10);
+                if (end == p) {
+                    break;
+                }
+                offset += delta;
+                emit_offset(offset);
+                p = end;
+            }
+            free(slot);
+            offsets_slots[j % OFFSETS_WINDOW] = NULL;
+        }
+        else {
+            for (long k = 0; k < chunk_counts[j]; k++) {
+                emit_offset(work_pool[j].offset + k);
+            }
+        }
+        offsets_next++;
+    }
+    if (offsets_out_len > 0) {
+        if (write(offsets_fd, offsets_out, offsets_out_len) != offsets_out_len) {
+            perror("[DISPATCHER] Failed to write offsets");
+        }
+        offsets_out_len = 0;
+    }
+    if (offsets_next == work_count) {
+        int len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] Offsets done: %ld matches written\n", offsets_written);
+        write(response_fd, buffer, len);
+        if (offsets_fd != response_fd) {
+            close(offsets_fd);
+        }
+        offsets_fd = -1;
+    }
+}
+
+// Function to start the offsets mode ("offsets <path>", "-" sends them to the frontend)
+// The workers must get the flag with every chunk, so it has to come before the first add
+void start_offsets(const char *args) {
+    char path[256];
+    if (sscanf(args, "%255s", path) != 1) {
+        fprintf(stderr, "[DISPATCHER] Usage: offsets <path or ->\n");
+        return;
+    }
+    if (needle_len <= 0 || gz_index != NULL) {
+        fprintf(stderr, "[DISPATCHER] Offsets need a plain search string and a plain file\n");
+        return;
+    }
+    if (offsets_fd != -1 || worker_count > 0 || processed_bytes > hole_bytes || sample_mode != 0) {
+        fprintf(stderr, "[DISPATCHER] Offsets must be asked for before the first add\n");
+        return;
+    }
+    if (strcmp(path, "-") == 0) {
+        offsets_fd = response_fd;
+    }
+    else if ((offsets_fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644)) == -1) {
+        perror("[DISPATCHER] Failed to create the offsets file");
+        return;
+    }
+    flush_offsets(); // Hole chunks at the start of the file are already counted
+}
+
+// Function to start the rank mode ("rank"), for an index of every byte of the class
+void start_rank() {
+    if (!class_mode || gz_index != NULL) {
+        fprintf(stderr, "[DISPATCHER] Rank counts need a byte class and a plain file\n");
+        return;
+    }
+    if (rank_mode || worker_count > 0 || processed_bytes > hole_bytes || sample_mode != 0) {
+        fprintf(stderr, "[DISPATCHER] Rank counts must be asked for before the first add\n");
+        return;
+    }
+    for (int b = 0; b < 256; b++) {
+        rank_width += byte_class.member[b];
+    }
+    rank_counts = calloc((long)work_count * rank_width, sizeof(long));
+    if (rank_counts == NULL) {
+        perror("[DISPATCHER] Rank count allocation failed");
+        rank_width = 0;
+        return;
+    }
+    // Hole chunks are already counted: all of their bytes are '\0', the first column if it is in the class
+    for (int j = 0; j < work_count && byte_class.member[0]; j++) {
+        if (chunk_done(j)) {
+            rank_counts[(long)j * rank_width] = work_pool[j].length;
+        }
+    }
+    rank_mode = 1;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Square root by Newton's method, so the dispatcher needs no libm
+double sqrt_newton(double x) {
+    if (x <= 0) {
+        return 0;
+    }
+    double r = (x > 1) ? x : 1;
+    for (int k = 0; k < 64; k++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) {
+            break;
+        }
+        r = next;
+    }
+    return r;
+}
+
+// Function to start the estimate, or change its tolerance and time budget
+// Every free chunk goes into the sample: the chunks of each stratum are shuffled
+// and the strata take turns, so any prefix of the order covers the whole file
+void start_estimate(const char *args) {
+    double tolerance = 0, seconds = 0;
+    if (sscanf(args, "%lf %lf", &tolerance, &seconds) < 1 || tolerance < 0 || seconds < 0) {
+        fprintf(stderr, "[DISPATCHER] Usage: estimate <tolerance %%> [seconds]\n");
+        return;
+    }
+    if (offsets_fd != -1) {
+        fprintf(stderr, "[DISPATCHER] No estimate while writing offsets\n");
+        return;
+    }
+    sample_tolerance = tolerance / 100;
+    sample_deadline = (seconds > 0) ? now_seconds() + seconds : 0;
+    last_estimate_report = now_seconds();
+    if (sample_mode != 0) {
+        sample_mode = 1; // Already sampling: only the limits change, a stopped estimate goes on
+        return;
+    }
+
+    sample_order = malloc(sizeof(int) * (work_count + 1));
+    int *by_stratum = malloc(sizeof(int) * (work_count + 1));
+    int stratum_next[SAMPLE_STRATA + 1];
+    sample_bits = calloc(work_count / (8 * sizeof(unsigned long)) + 1, sizeof(unsigned long));
+    if (!sample_order || !by_stratum || !sample_bits) {
+        perror("[DISPATCHER] Estimate allocation failed");
+        exit(1);
+    }
+
+    // The reserved runs go back to the free ranges, the sample is everything free
+    for (int k = 0; k < worker_count; k++) {
+        push_free_range(workers[k].run_next, workers[k].run_end);
+        workers[k].run_next = 0;
+        workers[k].run_end = 0;
+    }
+    long free_chunks = 0;
+    for (int r = 0; r < free_range_count; r++) {
+        free_chunks += free_ranges[r].end - free_ranges[r].start;
+    }
+    sample_strata = free_chunks / (2 * SAMPLE_MIN);
+    if (sample_strata > SAMPLE_STRATA) sample_strata = SAMPLE_STRATA;
+    if (sample_strata < 1) sample_strata = 1;
+
+    // Bucket the free chunks by stratum (counting sort), then shuffle each bucket
+    memset(strata, 0, sizeof(strata));
+    for (int r = 0; r < free_range_count; r++) {
+        for (int j = free_ranges[r].start; j < free_ranges[r].end; j++) {
+            strata[(long)j * sample_strata / work_count].population++;
+        }
+    }
+    stratum_next[0] = 0;
+    for (int s = 0; s < sample_strata; s++) {
+        stratum_next[s + 1] = stratum_next[s] + strata[s].population;
+    }
+    for (int r = 0; r < free_range_count; r++) {
+        for (int j = free_ranges[r].start; j < free_ranges[r].end; j++) {
+            by_stratum[stratum_next[(long)j * sample_strata / work_count]++] = j;
+            sample_bits[j / (8 * sizeof(unsigned long))] |= 1UL << (j % (8 * sizeof(unsigned long)));
+        }
+        range_slot[free_ranges[r].start] = -1;
+    }
+    free_range_count = 0;
+
+    srand(time(NULL) ^ getpid());
+    int first = 0;
+    for (int s = 0; s < sample_strata; s++) {
+        for (int k = strata[s].population - 1; k > 0; k--) {
+            int m = rand() % (k + 1);
+            int tmp = by_stratum[first + k];
+            by_stratum[first + k] = by_stratum[first + m];
+            by_stratum[first + m] = tmp;
+        }
+        stratum_next[s] = first; // Now the next chunk of the stratum to send
+        first += strata[s].population;
+    }
+
+    // Round robin over the strata
+    sample_len = 0;
+    sample_pos = 0;
+    for (long round = 0; sample_len < free_chunks; round++) {
+        for (int s = 0; s < sample_strata; s++) {
+            if (round < strata[s].population) {
+                sample_order[sample_len++] = by_stratum[stratum_next[s] + round];
+            }
+        }
+    }
+    free(by_stratum);
+
+    sample_base = total_characters_found; // Chunks still in flight are added when they finish
+    sample_mode = 1;
+    fprintf(stderr, "[DISPATCHER] Estimating from %d chunks in %d strata\n", sample_len, sample_strata);
+}
+
+// Function to compute the estimate of the total from the finished sample chunks
+// Stratified estimator: every stratum adds population * mean, and its variance
+// population^2 * (1 - n/population) * s^2 / n, which is 0 once it is all done
+// Returns 0 while some stratum has too few chunks for an interval
+int compute_estimate(double *estimate, double *half_width) {
+    double variance = 0;
+    int ready = 1;
+    *estimate = sample_base;
+    for (int s = 0; s < sample_strata; s++) {
+        Stratum *st = &strata[s];
+        if (st->sampled == st->population) {
+            *estimate += st->sum; // Exact
+            continue;
+        }
+        if (st->sampled < SAMPLE_MIN) {
+            ready = 0;
+            if (st->sampled == 0) {
+                continue;
+            }
+        }
+        double n = st->sampled, N = st->population;
+        double mean = st->sum / n;
+        *estimate += N * mean;
+        if (n > 1) {
+            double s2 = (st->sumsq - n * mean * mean) / (n - 1);
+            if (s2 < 0) s2 = 0;
+            variance += N * N * (1 - n / N) * s2 / n;
+        }
+    }
+    *half_width = ESTIMATE_Z * sqrt_newton(variance);
+    return ready;
+}
+
+// Function to send the running estimate to the frontend
+void show_estimate(const char *note) {
+    char buffer[256];
+    double estimate, half_width;
+    if (sample_mode == 0) {
+        fprintf(stderr, "[DISPATCHER] Not estimating, use: estimate <tolerance %%> [seconds]\n");
+        return;
+    }
+    int len;
+    if (compute_estimate(&estimate, &half_width)) {
+        len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] Estimate: %.0f +- %.0f (95%%), %.2f%% of the file scanned%s\n",
+                       estimate, half_width, (processed_bytes * 100.0) / total_file_size, note);
+    }
+    else {
+        len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] Estimate: %.0f (too few chunks for an interval), %.2f%% of the file scanned%s\n",
+                       estimate, (processed_bytes * 100.0) / total_file_size, note);
+    }
+    write(response_fd, buffer, len);
+}
+
+// Function to report the estimate and stop once it is tight enough or out of time
+// Called from the main loop; a stopped estimate sends no more chunks
+void check_estimate() {
+    double estimate, half_width;
+    if (sample_mode != 1) {
+        return;
+    }
+    double now = now_seconds();
+    int ready = compute_estimate(&estimate, &half_width);
+
+    if (processed_bytes == total_file_size) {
+        show_estimate(" - exact, every chunk scanned");
+        sample_mode = 2;
+    }
+    else if (ready && sample_tolerance > 0 && half_width <= sample_tolerance * estimate) {
+        show_estimate(" - tolerance reached, stopped");
+        sample_mode = 2;
+    }
+    else if (sample_deadline > 0 && now >= sample_deadline) {
+        show_estimate(" - time budget over, stopped");
+        sample_mode = 2;
+    }
+    else if (now - last_estimate_report >= ESTIMATE_REPORT_SEC) {
+        show_estimate("");
+        last_estimate_report = now;
+    }
+}
+
+// Function to cancel the job
+// SIGUSR1 makes every busy worker abandon its chunk mid-read and answer
+// "cancelled"; the partial counts so far are kept
+void cancel_job(const char *reason) {
+    char buffer[256];
+    if (job_cancelled) {
+        fprintf(stderr, "[DISPATCHER] Job already cancelled\n");
+        return;
+    }
+    job_cancelled = 1;
+    job_deadline = 0;
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i].alive && workers[i].assigned_chunks > 0) {
+            kill(workers[i].pid, SIGUSR1);
+        }
+    }
+    int len = snprintf(buffer, sizeof(buffer), "[DISPATCHER] Job cancelled (%s) at %.2f%%, characters found so far: %d\n",
+                       reason, (processed_bytes * 100.0) / total_file_size, total_characters_found);
+    write(response_fd, buffer, len);
+}
+
+// Function to set the deadline of the job, 0 removes it
+void set_deadline(const char *args) {
+    double seconds;
+    if (sscanf(args, "%lf", &seconds) != 1 || seconds < 0) {
+        fprintf(stderr, "[DISPATCHER] Usage: deadline <seconds>\n");
+        return;
+    }
+    job_deadline = (seconds > 0) ? now_seconds() + seconds : 0;
+}
+
+// Function to go on with a cancelled job, the abandoned chunks are back in the pool
+void resume_job() {
+    if (!job_cancelled) {
+        fprintf(stderr, "[DISPATCHER] Job not cancelled\n");
+        return;
+    }
+    job_cancelled = 0;
+    assign_work();
+}
+
+// Function to create the shared token bucket before the zygote and the first worker
+// The memfd is inherited (no close-on-exec) and its number is passed in the
+// environment; a worker without it runs unlimited
+void create_throttle() {
+    int fd = memfd_create("worker-throttle", 0);
+    if (fd == -1 || ftruncate(fd, sizeof(Throttle)) == -1) {
+        perror("[DISPATCHER] No shared throttle, the workers read at full speed");
+        if (fd != -1) close(fd);
+        return;
+    }
+    throttle = mmap(NULL, sizeof(Throttle), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (throttle == MAP_FAILED) {
+        perror("[DISPATCHER] No shared throttle, the workers read at full speed");
+        throttle = NULL;
+        close(fd);
+        return;
+    }
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(THROTTLE_ENV, value, 1);
+}
+
+// Function to change the rate limit and the priority of the workers at runtime
+// "throttle <MB/s> [idle | nice <N> | normal]", "throttle off" removes the limit
+// (and "throttle off normal" the priority too). The workers see the new rate at
+// their next read and the new priority at their next chunk
+void set_throttle(const char *args) {
+    char buffer[256];
+    char rate_arg[32], priority[16] = "";
+    int nice_value = 0;
+    double mb_s = 0;
+    int fields = sscanf(args, "%31s %15s %d", rate_arg, priority, &nice_value);
+    if (fields < 1 || (strcmp(rate_arg, "off") != 0 && (sscanf(rate_arg, "%lf", &mb_s) != 1 || mb_s <= 0))
+        || (fields >= 2 && strcmp(priority, "idle") != 0 && strcmp(priority, "normal") != 0 && strcmp(priority, "nice") != 0)
+        || (strcmp(priority, "nice") == 0 && (fields < 3 || nice_value < -20 || nice_value > 19))) {
+        fprintf(stderr, "[DISPATCHER] Usage: throttle <MB/s or off> [idle | nice <N> | normal]\n");
+        return;
+    }
+    if (throttle == NULL) {
+        fprintf(stderr, "[DISPATCHER] No shared throttle, the limit cannot be set\n");
+        return;
+    }
+
+    long rate = (long)(mb_s * 1024 * 1024);
+    __atomic_store_n(&throttle->rate, rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&throttle->empty_ns, 0, __ATOMIC_RELAXED); // Start full, the old debt was for the old rate
+    if (fields >= 2) {
+        throttle->io_idle = (strcmp(priority, "idle") == 0);
+        throttle->nice = (strcmp(priority, "nice") == 0) ? nice_value : 0;
+        __atomic_add_fetch(&throttle->generation, 1, __ATOMIC_RELEASE);
+    }
+
+    int len = (rate > 0) ? snprintf(buffer, sizeof(buffer), "[DISPATCHER] Throttle %.1f MB/s", mb_s)
+                         : snprintf(buffer, sizeof(buffer), "[DISPATCHER] Throttle off");
+    len += snprintf(buffer + len, sizeof(buffer) - len, ", %s I/O, nice %d\n",
+                    throttle->io_idle ? "idle" : "normal", throttle->nice);
+    write(response_fd, buffer, len);
+}
+
+// Function to map the gzip index at path if it is valid for the input
+// Returns -1 if it is missing, damaged or older than the input
+int map_gz_index(const char *path, struct stat *input_st) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    const GzIndexHeader *header = map_gz_index_fd(fd, input_st);
+    close(fd);
+    if (header == NULL) {
+        return -1;
+    }
+    gz_index = header;
+    gz_points = (const GzPoint *)(header + 1);
+    return 0;
+}
+
+// Function to write the gzip index to out_fd in one pass (zran): inflate block by block
+// (Z_BLOCK) and at the first block boundary after every GZ_SPAN bytes of output
+// save an access point, with the 32KB of history from the circular window.
+// Several gzip members are inflated one after the other
+// Returns -1 on error
+int write_gz_index(int out_fd, struct stat *input_st) {
+    static unsigned char input[GZ_CHUNK], window[GZ_WINDOW];
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 47) != Z_OK) { // Automatic gzip/zlib header
+        return -1;
+    }
+    GzIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GZ_INDEX_MAGIC, sizeof(GZ_INDEX_MAGIC));
+    header.compressed_size = input_st->st_size;
+    header.mtime_sec = input_st->st_mtim.tv_sec;
+    header.mtime_nsec = input_st->st_mtim.tv_nsec;
+    lseek(input_fd, 0, SEEK_SET);
+    int ok = (write(out_fd, &header, sizeof(header)) == sizeof(header));
+
+    long totin = 0, totout = 0, last = 0;
+    int ended = 0;
+    static GzPoint point;
+    while (ok) {
+        if (strm.avail_in == 0) {
+            ssize_t n = read(input_fd, input, sizeof(input));
+            if (n <= 0) {
+                ok = (n == 0 && ended); // A truncated stream is an error
+                break;
+            }
+            strm.next_in = input;
+            strm.avail_in = n;
+        }
+        if (ended) {
+            inflateReset(&strm); // Another gzip member follows
+            ended = 0;
+        }
+        if (strm.avail_out == 0) {
+            strm.next_out = window;
+            strm.avail_out = GZ_WINDOW;
+        }
+        totin += strm.avail_in;
+        totout += strm.avail_out;
+        int ret = inflate(&strm, Z_BLOCK);
+        totin -= strm.avail_in;
+        totout -= strm.avail_out;
+        if (ret == Z_STREAM_END) {
+            ended = 1;
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "[DISPATCHER] Bad gzip data at byte %ld\n", totin);
+            ok = 0;
+            break;
+        }
+        // At a block boundary, not the last block of a member
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last >= GZ_SPAN)) {
+            unsigned left = strm.avail_out; // The window is circular, the oldest bytes are at next_out
+            point.out = totout;
+            point.in = totin;
+            point.bits = strm.data_type & 7;
+            memcpy(point.window, window + GZ_WINDOW - left, left);
+            memcpy(point.window + left, window, GZ_WINDOW - left);
+            ok = (write(out_fd, &point, sizeof(point)) == sizeof(point));
+            header.points++;
+            last = totout;
+        }
+    }
+    inflateEnd(&strm);
+    header.uncompressed_size = totout;
+    if (ok) {
+        ok = (pwrite(out_fd, &header, sizeof(header), 0) == sizeof(header));
+    }
+    return ok ? 0 : -1;
+}
+
+// Function to build the gzip index into path, through a temporary file so a
+// worker never maps a half-written index
+// Returns -1 if path cannot be written
+int build_gz_index(const char *path, struct stat *input_st) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int out_fd = open(tmp_path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd == -1) {
+        return -1;
+    }
+    int ok = (write_gz_index(out_fd, input_st) == 0);
+    close(out_fd);
+    if (!ok || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to load the cached index of a gzip input, or build it once
+// Both the dispatcher and the workers map it; it is rebuilt when the input changes.
+// It goes to the first of the GZ_INDEX_PLACES that is writable; if none is, it
+// is built in a memfd that the workers inherit, like the throttle, and is lost
+// when the dispatcher exits
+void open_gz_index(struct stat *st) {
+    char path[4096];
+    for (int k = 0; k < GZ_INDEX_PLACES; k++) {
+        if (gz_index_path(input_file, st, k, path, sizeof(path)) == 0 && map_gz_index(path, st) == 0) {
+            fprintf(stderr, "[DISPATCHER] gzip index %s loaded: %ld access points, %ld bytes uncompressed\n",
+                    path, gz_index->points, gz_index->uncompressed_size);
+            return;
+        }
+    }
+    double start = now_seconds();
+    for (int k = 0; k < GZ_INDEX_PLACES; k++) {
+        if (gz_index_path(input_file, st, k, path, sizeof(path)) == 0 && build_gz_index(path, st) == 0) {
+            if (map_gz_index(path, st) == -1) {
+                break;
+            }
+            fprintf(stderr, "[DISPATCHER] gzip index %s built in %.2fs: %ld access points, %ld bytes uncompressed\n",
+                    path, now_seconds() - start, gz_index->points, gz_index->uncompressed_size);
+            return;
+        }
+    }
+    int fd = memfd_create("gz-index", 0);
+    if (fd == -1 || write_gz_index(fd, st) == -1 || (gz_index = map_gz_index_fd(fd, st)) == NULL) {
+        fprintf(stderr, "[DISPATCHER] Failed to build the gzip index of %s\n", input_file);
+        exit(1);
+    }
+    gz_points = (const GzPoint *)(gz_index + 1);
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(GZ_INDEX_FD_ENV, value, 1);
+    fprintf(stderr, "[DISPATCHER] gzip index built in memory in %.2fs (no writable place for it): %ld access points, %ld bytes uncompressed\n",
+            now_seconds() - start, gz_index->points, gz_index->uncompressed_size);
+}
+
+// Function to put the chunks that are already in the page cache first
+// mincore() on a mapping of the file gives the resident pages. The free ranges
+// are split where residency changes and pushed again, cold ones first, so the
+// cached ones are on top of the stack. While the workers count those, the
+// cold ranges next in line are prefetched with POSIX_FADV_WILLNEED.
+void order_by_residency() {
+    long page = sysconf(_SC_PAGESIZE);
+    if (free_range_count == 0 || total_file_size == 0 || gz_index != NULL) {
+        return;
+    }
+    void *map = mmap(NULL, total_file_size, PROT_READ, MAP_SHARED, input_fd, 0);
+    if (map == MAP_FAILED) {
+        return; // Keep the offset order
+    }
+    unsigned char *vec = malloc((total_file_size + page - 1) / page);
+    Range *old = malloc(sizeof(Range) * free_range_count);
+    if (vec == NULL || old == NULL || mincore(map, total_file_size, vec) == -1) {
+        free(vec);
+        free(old);
+        munmap(map, total_file_size);
+        return;
+    }
+    munmap(map, total_file_size);
+
+    int old_count = free_range_count;
+    memcpy(old, free_ranges, sizeof(Range) * old_count);
+    for (int r = 0; r < old_count; r++) {
+        range_slot[old[r].start] = -1;
+    }
+    free_range_count = 0;
+
+    // Pass 0 pushes the cold pieces, pass 1 the resident ones on top of them
+    long resident_chunks = 0, data_chunks = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int r = 0; r < old_count; r++) {
+            int piece = old[r].start;
+            int piece_resident = -1;
+            for (int j = old[r].start; j <= old[r].end; j++) {
+                int resident = 0;
+                if (j < old[r].end) {
+                    resident = 1;
+                    off_t last = work_pool[j].offset + work_pool[j].length - 1;
+                    for (off_t pg = work_pool[j].offset / page; pg <= last / page; pg++) {
+                        resident &= vec[pg] & 1;
+                    }
+                    if (pass == 0) {
+                        data_chunks++;
+                        resident_chunks += resident;
+                    }
+                }
+                if (j == old[r].end || (piece_resident != -1 && resident != piece_resident)) {
+                    if (piece_resident == pass) {
+                        push_free_range(piece, j);
+                        free_ranges[free_range_count - 1].cold = !piece_resident;
+                    }
+                    piece = j;
+                }
+                piece_resident = resident;
+            }
+        }
+    }
+    free(vec);
+    free(old);
+
+    // Prefetch the cold ranges that come right after the cached ones
+    off_t warm = 0;
+    for (int r = free_range_count - 1; r >= 0 && warm < WARM_AHEAD; r--) {
+        if (free_ranges[r].cold) {
+            off_t start = work_pool[free_ranges[r].start].offset;
+            off_t length = work_pool[free_ranges[r].end - 1].offset + work_pool[free_ranges[r].end - 1].length - start;
+            if (length > WARM_AHEAD - warm) {
+                length = WARM_AHEAD - warm;
+            }
+            posix_fadvise(input_fd, start, length, POSIX_FADV_WILLNEED);
+            warm += length;
+        }
+    }
+    if (resident_chunks > 0 && resident_chunks < data_chunks) {
+        fprintf(stderr, "[DISPATCHER] Page cache: %ld of %ld chunks resident, scheduled first\n",
+                resident_chunks, data_chunks);
+    }
+}
+
 // Function to check for dead workers
 // It waits for any dead workers and restarts them
 void check_dead_workers() {
     int status;
     pid_t pid;
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == zygote_pid) {
+            fprintf(stderr, "[DISPATCHER] Zygote died, spawning workers directly\n");
+            zygote_pid = -1;
+            close(zygote_fd);
+            zygote_fd = -1;
+            continue;
+        }
+        for (int i = 0; i < standby_count; i++) {
+            if (standby[i].pid == pid) {
+                // Idle worker died, drop it; fill_standby() replaces it
+                close(standby[i].to_worker_fd);
+                close(standby[i].from_worker_fd);
+                standby[i] = standby[--standby_count];
+                break;
+            }
+        }
         for (int i = 0; i < worker_count; i++) {
             if (workers[i].pid == pid) {
                 workers[i].alive = 0;
                 printf("[DISPATCHER] Worker (PID: %d) died, restarting...\n", pid);
                 spawn_worker_at(i);
                 // Make available the work assigned to this worker
-                for (int j = 0; j < work_count; j++) {
-                    if (work_pool[j].assigned_worker == i && work_pool[j].done == 0) {
-                        work_pool[j].assigned = 0;
-                        work_pool[j].assigned_worker = -1;
-                    }
-                }
+                // last_done is kept, so the new worker resumes where the old one stopped
+                release_worker_work(i);
                 break;
             }
         }
@@ -337,7 +2043,7 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, handle_sigterm);
     signal(SIGUSR1, handle_sigusr1);
 
-    int fd = open(input_file, O_RDONLY);
+    int fd = open(input_file, O_RDONLY | O_CLOEXEC); // The workers open the file themselves
     if (fd == -1) {
         perror("open failed");
         exit(1);
@@ -349,13 +2055,69 @@ int main(int argc, char *argv[]) {
         close(fd);
         exit(1);
     }
-    close(fd); // Κλείνουμε το αρχείο αφού πάρουμε το μέγεθος
+    input_fd = fd; // Μένει ανοιχτό για τα readahead hints (posix_fadvise)
     total_file_size = st.st_size;
 
+    // A ".gz" input is counted in uncompressed bytes, through its access points
+    size_t name_len = strlen(input_file);
+    if (name_len > 3 && strcmp(input_file + name_len - 3, ".gz") == 0) {
+        open_gz_index(&st);
+        total_file_size = gz_index->uncompressed_size;
+        if (is_utf8_arg(character)) {
+            fprintf(stderr, "[DISPATCHER] U+XXXX is not supported for .gz inputs\n");
+            exit(1);
+        }
+    }
+
+    if (character[0] == '@') {
+        load_patterns(character + 1);
+    }
+
     // --- Δημιουργία του work pool ---
     create_work_pool();
+    if (strcmp(character, "--wc") == 0) {
+        wc_mode = 1;
+        wc_chunks = calloc(work_count + 1, sizeof(WcStats));
+        if (wc_chunks == NULL) {
+            perror("[DISPATCHER] wc allocation failed");
+            exit(1);
+        }
+    }
+    else if (is_utf8_arg(character)) {
+        // Parsed as the workers do, or every worker would exit and be restarted
+        Utf8Target target;
+        if (parse_utf8_target(character, &target) == -1) {
+            fprintf(stderr, "[DISPATCHER] Invalid code point %s\n", character);
+            exit(1);
+        }
+        utf8_mode = 1;
+        utf8_target = target.codepoint;
+        align_chunks_to_utf8();
+    }
+    else if (parse_byte_class(character, &byte_class) == 0) {
+        class_mode = 1; // "[" or "[i" stay ordinary search strings, as in the worker
+    }
+    else if (character[0] != '@') {
+        needle_len = unescape_needle(character, needle);
+        if (needle_len == -1) {
+            // Checked here as the workers do, or every worker would exit and be restarted
+            fprintf(stderr, "[DISPATCHER] I need a search string of 1 to 256 bytes, \\xHH with two hex digits\n");
+            exit(1);
+        }
+    }
+    map_holes(); // Holes are counted here, only data chunks go to the workers
+    order_by_residency();
+
+    // Zygote and standby workers, so that add only has to hand over a ready worker
+    signal(SIGPIPE, SIG_IGN); // A dead zygote must not kill the dispatcher
+    create_throttle(); // Before any worker, they all map it
+    start_zygote();
+    fill_standby();
 
     char command[256];
+    // Unbuffered stdin: commands that arrive together ("resume" and "deadline 5")
+    // must not wait in the stdio buffer, where select() cannot see them
+    setvbuf(stdin, NULL, _IONBF, 0);
     fd_set readfds;
     fprintf(stderr, "[DISPATCHER] Waiting for command...\n");
 
@@ -365,6 +2127,7 @@ int main(int argc, char *argv[]) {
     while (1) {
         // 1. Βήμα: δώσε δουλειά σε ελεύθερους workers
         assign_work();
+        fill_standby(); // Replace the standby workers used by add or restarts
 
         FD_ZERO(&readfds);
         FD_SET(STDIN_FILENO, &readfds);
@@ -379,7 +2142,18 @@ int main(int argc, char *argv[]) {
             }
         }
     
-        if (select(maxfd + 1, &readfds, NULL, NULL, NULL) == -1) {
+        // While estimating wake up every second for the report and the time budget,
+        // and with a deadline wake up in time for it
+        struct timeval tick = {ESTIMATE_REPORT_SEC, 0};
+        if (job_deadline > 0) {
+            double left = job_deadline - now_seconds();
+            if (left < 0) left = 0;
+            if (left < ESTIMATE_REPORT_SEC) {
+                tick.tv_sec = (long)left;
+                tick.tv_usec = (long)((left - tick.tv_sec) * 1e6);
+            }
+        }
+        if (select(maxfd + 1, &readfds, NULL, NULL, (sample_mode == 1 || job_deadline > 0) ? &tick : NULL) == -1) {
             perror("select failed");
             continue;
         }
@@ -390,9 +2164,21 @@ int main(int argc, char *argv[]) {
                 command[strcspn(command, "\n")] = '\0'; // Remove newline character
                 // Εδώ ελέγχεις την εντολή
                 if (strcmp(command, "add") == 0) spawn_worker();
+                else if (strncmp(command, "group ", 6) == 0) spawn_group(command + 6);
                 else if (strcmp(command, "remove") == 0) remove_worker();
-                else if (strcmp(command, "status") == 0) show_pstree(getpid());
+                else if (strcmp(command, "status") == 0) show_status();
                 else if (strcmp(command, "progress") == 0) kill(getpid(), SIGUSR1);
+                else if (strcmp(command, "counts") == 0) show_pattern_counts();
+                else if (strcmp(command, "wc") == 0) show_wc();
+                else if (strcmp(command, "estimate") == 0) show_estimate("");
+                else if (strncmp(command, "estimate ", 9) == 0) start_estimate(command + 9);
+                else if (strcmp(command, "cancel") == 0) cancel_job("cancel");
+                else if (strncmp(command, "deadline ", 9) == 0) set_deadline(command + 9);
+                else if (strcmp(command, "resume") == 0) resume_job();
+                else if (strncmp(command, "index ", 6) == 0) write_index(command + 6);
+                else if (strncmp(command, "offsets ", 8) == 0) start_offsets(command + 8);
+                else if (strcmp(command, "rank") == 0) start_rank();
+                else if (strncmp(command, "throttle ", 9) == 0) set_throttle(command + 9);
                 else if (strcmp(command, "quit") == 0) handle_sigterm(SIGTERM);
                 else fprintf(stderr, "[DISPATCHER] Unknown command\n");
             }
@@ -408,6 +2194,10 @@ int main(int argc, char *argv[]) {
         }
         assign_work();
         check_dead_workers();
+        check_estimate();
+        if (job_deadline > 0 && now_seconds() >= job_deadline) {
+            cancel_job("deadline");
+        }
     }
 
     // Καθάρισμα - Κλείσιμο Dispatcher 
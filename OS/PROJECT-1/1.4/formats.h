@@ -0,0 +1,133 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+// Layouts of the files and shared memory that one program of 1.4 writes and
+// another one reads, declared once so the two sides cannot drift apart
+// (dispatcher.c, worker.c, rangecount.c include it as "formats.h")
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../search.h"
+
+#define INDEX_MAGIC "CNTIDX3" // First bytes of a range index file
+
+// Header of a range index file ("index" command), followed by blocks + 1 rows of
+// columns longs: entry (k, m) is the number of matches of column m that start
+// before byte k * block_size. The size and mtime of the input file tell the
+// reader if the index is stale.
+// The search is the one of the job the index was built from: a decoded
+// substring (one column), or a byte class kept as its "[...]" argument, with
+// one column for the whole class, or after "rank" one per byte of the class
+// in byte order, so a query can count any subset of the class
+typedef struct {
+    char magic[8];
+    long file_size;
+    long mtime_sec;
+    long mtime_nsec;
+    long block_size;
+    long blocks;
+    int needle_len;
+    int is_class; // 1 = needle is a "[...]" byte class argument, its matches are single bytes
+    int columns;
+    char needle[MAX_NEEDLE];
+} IndexHeader;
+
+#define GZ_WINDOW 32768 // Deflate history, saved at every access point
+#define GZ_INDEX_MAGIC "GZIDX1"
+#define GZ_INDEX_PLACES 3 // Next to the input, the user's cache directory, /tmp
+#define GZ_INDEX_FD_ENV "WORKER_GZ_INDEX_FD" // Index kept in a memfd, when none of the places is writable
+
+// Access point of a gzip input (zran): the uncompressed offset of a deflate
+// block, where it starts in the compressed file and the 32KB of output before
+// it, enough for a worker to start inflating there. The index is cached next
+// to the input as "<file>.zidx": a GzIndexHeader followed by the points
+typedef struct {
+    long out;
+    long in; // First full byte of the block in the compressed file
+    int bits; // Bits of the byte before "in" that belong to the block (0-7)
+    unsigned char window[GZ_WINDOW];
+} GzPoint;
+
+typedef struct {
+    char magic[8];
+    long compressed_size;
+    long mtime_sec;
+    long mtime_nsec;
+    long uncompressed_size;
+    long points;
+} GzIndexHeader;
+
+// Path of the gzip index of an input in place k (0 to GZ_INDEX_PLACES - 1):
+// "<file>.zidx", else named by device and inode in $XDG_CACHE_HOME (or
+// ~/.cache) and in /tmp, for inputs in a directory we cannot write to.
+// The dispatcher and the workers try the places in the same order
+// Returns -1 if place k does not exist (no cache directory)
+static inline int gz_index_path(const char *input_file, const struct stat *input_st, int k, char *path, size_t size) {
+    const char *dir = NULL, *sub = "";
+    if (k == 0) {
+        snprintf(path, size, "%s.zidx", input_file);
+        return 0;
+    }
+    if (k == 1) {
+        dir = getenv("XDG_CACHE_HOME");
+        if (dir == NULL || dir[0] == '\0') {
+            dir = getenv("HOME");
+            sub = "/.cache";
+        }
+        if (dir == NULL || dir[0] == '\0') {
+            return -1;
+        }
+    }
+    else if (k == 2) {
+        dir = "/tmp";
+    }
+    else {
+        return -1;
+    }
+    snprintf(path, size, "%s%s/counter-%d-%lx-%lx.zidx", dir, sub, (int)getuid(),
+             (unsigned long)input_st->st_dev, (unsigned long)input_st->st_ino);
+    return 0;
+}
+
+// Map the gzip index in fd if it is valid for the input (same size and mtime)
+// Returns NULL if it is damaged or older than the input
+static inline const GzIndexHeader *map_gz_index_fd(int fd, const struct stat *input_st) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(GzIndexHeader)) {
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const GzIndexHeader *header = map;
+    if (memcmp(header->magic, GZ_INDEX_MAGIC, sizeof(GZ_INDEX_MAGIC)) != 0
+        || header->compressed_size != input_st->st_size
+        || header->mtime_sec != input_st->st_mtim.tv_sec || header->mtime_nsec != input_st->st_mtim.tv_nsec
+        || st.st_size != (off_t)(sizeof(GzIndexHeader) + header->points * sizeof(GzPoint))) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+#define THROTTLE_ENV "WORKER_THROTTLE_FD" // Tells the workers which fd holds the shared token bucket
+
+// Read rate limit shared by all the workers ("throttle" command), in a memfd
+// that every worker maps. The bucket is kept as the time it runs dry (GCRA):
+// a read of n bytes pushes it n / rate seconds further, and a worker that
+// pushes it more than THROTTLE_BURST_MS (worker.c) past now sleeps for the difference.
+// The priority fields are applied by every worker before its next chunk
+typedef struct {
+    long rate; // Bytes per second for all the workers together, 0 = no limit
+    long empty_ns; // CLOCK_MONOTONIC time the bucket runs dry
+    int io_idle; // 1 = IOPRIO_CLASS_IDLE, the disk only serves the workers when it is otherwise idle
+    int nice; // Nice value of the workers
+    int generation; // Bumped on every priority change
+} Throttle;
+
+#endif
@@ -50,8 +50,13 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (argv[2][1] != '\0') {
-        perror("[FRONTEND] Wrong character input at position 2");
+    // Any non-empty string: a single character, a token like "ERROR" or "\r\n",
+    // "@file" to count every pattern listed in the file in one pass,
+    // "U+XXXX" to count a Unicode code point in UTF-8 text,
+    // "[0-9a-f]" to count the bytes of a class (sets, ranges, "^" negates),
+    // or "--wc" for line, word and byte statistics (words as LC_ALL=C wc -w counts them)
+    if (argv[2][0] == '\0') {
+        perror("[FRONTEND] Empty search string at position 2");
         return 2;
     }
 
@@ -97,7 +102,7 @@ int main(int argc, char *argv[]) {
         close(cmd_pipe[0]);
         close(response_pipe[1]);
 
-        printf("\n[FRONTEND] Ready. Available commands: add, remove, status, progress, quit\n");
+        printf("\n[FRONTEND] Ready. Available commands: add, group <fan-out> [levels], remove, status, progress, counts, wc, rank, estimate <tolerance %%> [seconds], cancel, deadline <seconds>, resume, index <path> [block KB], offsets <path or ->, throttle <MB/s or off> [idle | nice <N> | normal], quit\n");
         
         char command[MAX_CMD_LEN];
         fd_set readfds;
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// IPC transport benchmark for the dispatcher: the same messages over pipes of
+// several sizes, socketpairs, POSIX message queues and shared-memory rings
+// signalled with an eventfd or a futex, from one or many producer processes.
+// As in the dispatcher, stream transports and rings have one lane (pipe,
+// socket, ring) per producer and the consumer polls them all; the message
+// transports (seqpacket, mqueue) are shared, every message arrives whole.
+// Each cell has two phases:
+//  - latency: every producer sends one message and waits for the consumer's
+//    ack; the one-way time comes from a timestamp in the message
+//  - throughput: every producer sends its share as fast as it can
+// Build: gcc -O2 -o ipc-bench ipc-bench.c -lrt
+// Usage: ./ipc-bench [producers] [MB per cell]
+// Cells that a transport cannot do (e.g. a message over the mqueue limit) are n/a.
+
+#define MAX_PRODUCERS 64
+#define MIN_MSG 8
+#define MAX_MSG (1024 * 1024)
+#define MSG_STEP 8 // 8 B, 64 B, ... 1 MB
+#define MIN_MESSAGES 200 // Throughput messages per cell, at least
+#define MAX_MESSAGES 100000 // and at most
+#define LATENCY_SAMPLES 1000 // Ping-pong messages per cell, shared by the producers
+#define RING_SLOTS 8 // Messages per shared-memory ring
+#define MQ_DEPTH 8
+
+enum { T_PIPE, T_STREAM, T_SEQPACKET, T_MQ, T_EVENTFD, T_FUTEX };
+
+typedef struct {
+    const char *name;
+    int kind;
+    int pipe_size; // F_SETPIPE_SZ, 0 = default
+} Transport;
+
+// One single-producer ring per lane, head and tail on their own cache lines
+typedef struct {
+    _Atomic unsigned head; // Next slot the consumer reads
+    char pad1[60];
+    _Atomic unsigned tail; // Next slot the producer writes
+    char pad2[60];
+} Ring;
+
+// Start of the shared memory of the ring transports
+typedef struct {
+    _Atomic int seq; // Messages pushed, the futex word
+    _Atomic int waiting; // The consumer sleeps on seq
+    char pad[56];
+} Control;
+
+typedef struct {
+    int kind;
+    size_t size; // Message size of the cell
+    int lanes;
+    int fds[MAX_PRODUCERS][2]; // Pipe or socket of every lane; seqpacket uses fds[0] only
+    mqd_t mq;
+    int efd;
+    void *shm;
+    size_t shm_size;
+    Control *control;
+    Ring *rings;
+    char *slots;
+    int next_lane; // Where the consumer looks first, round robin
+} Channel;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Write or read exactly len bytes of a stream
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+long futex(_Atomic int *addr, int op, int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0); // Not private: shared between processes
+}
+
+// Create the channel before the producers are forked
+// Returns -1 if the transport cannot carry messages of this size
+int chan_open(Channel *c, const Transport *t, size_t size, int lanes) {
+    memset(c, 0, sizeof(*c));
+    c->kind = t->kind;
+    c->size = size;
+    c->lanes = lanes;
+    c->efd = -1;
+    c->mq = (mqd_t)-1;
+
+    if (t->kind == T_PIPE || t->kind == T_STREAM) {
+        for (int l = 0; l < lanes; l++) {
+            int ok = (t->kind == T_PIPE) ? pipe(c->fds[l]) : socketpair(AF_UNIX, SOCK_STREAM, 0, c->fds[l]);
+            if (ok == -1) {
+                return -1;
+            }
+            if (t->pipe_size > 0 && fcntl(c->fds[l][1], F_SETPIPE_SZ, t->pipe_size) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (t->kind == T_SEQPACKET) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, c->fds[0]) == -1) {
+            return -1;
+        }
+        // A whole message must fit in the send buffer (FORCE goes past wmem_max as root)
+        int buf = (size * 4 > 65536) ? size * 4 : 65536;
+        for (int k = 0; k < 2; k++) {
+            if (setsockopt(c->fds[0][k], SOL_SOCKET, SO_SNDBUFFORCE, &buf, sizeof(buf)) == -1) {
+                setsockopt(c->fds[0][k], SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+            }
+            setsockopt(c->fds[0][k], SOL_SOCKET, SO_RCVBUFFORCE, &buf, sizeof(buf));
+        }
+        int got = 0;
+        socklen_t len = sizeof(got);
+        getsockopt(c->fds[0][1], SOL_SOCKET, SO_SNDBUF, &got, &len);
+        return ((size_t)got >= size + 1024) ? 0 : -1;
+    }
+    if (t->kind == T_MQ) {
+        char name[64];
+        struct mq_attr attr = { .mq_maxmsg = MQ_DEPTH, .mq_msgsize = size };
+        snprintf(name, sizeof(name), "/ipc-bench-%d", getpid());
+        c->mq = mq_open(name, O_CREAT | O_EXCL | O_RDWR, 0600, &attr);
+        if (c->mq == (mqd_t)-1) {
+            return -1; // Usually over /proc/sys/fs/mqueue/msgsize_max
+        }
+        mq_unlink(name);
+        return 0;
+    }
+
+    // Rings: control block, one Ring per lane, then the slots of every lane
+    c->shm_size = sizeof(Control) + lanes * sizeof(Ring) + (size_t)lanes * RING_SLOTS * size;
+    c->shm = mmap(NULL, c->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (c->shm == MAP_FAILED) {
+        c->shm = NULL;
+        return -1;
+    }
+    c->control = c->shm;
+    c->rings = (Ring *)(c->control + 1);
+    c->slots = (char *)(c->rings + lanes);
+    if (t->kind == T_EVENTFD && (c->efd = eventfd(0, 0)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void chan_close(Channel *c) {
+    for (int l = 0; l < MAX_PRODUCERS; l++) {
+        for (int k = 0; k < 2; k++) {
+            if (c->fds[l][k] > 0) close(c->fds[l][k]);
+        }
+    }
+    if (c->mq != (mqd_t)-1) mq_close(c->mq);
+    if (c->efd != -1) close(c->efd);
+    if (c->shm != NULL) munmap(c->shm, c->shm_size);
+}
+
+// Producer side: send one message on lane l
+int chan_send(Channel *c, int l, const char *buf) {
+    switch (c->kind) {
+    case T_PIPE:
+    case T_STREAM:
+        return write_all(c->fds[l][1], buf, c->size);
+    case T_SEQPACKET:
+        return (send(c->fds[0][1], buf, c->size, 0) == (ssize_t)c->size) ? 0 : -1;
+    case T_MQ:
+        return mq_send(c->mq, buf, c->size, 0);
+    default: {
+        Ring *r = &c->rings[l];
+        unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&r->head, memory_order_acquire) == RING_SLOTS) {
+            sched_yield(); // Full: the consumer is behind
+        }
+        memcpy(c->slots + ((size_t)l * RING_SLOTS + tail % RING_SLOTS) * c->size, buf, c->size);
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        if (c->kind == T_EVENTFD) {
+            uint64_t one = 1;
+            return (write(c->efd, &one, sizeof(one)) == sizeof(one)) ? 0 : -1;
+        }
+        atomic_fetch_add(&c->control->seq, 1);
+        if (atomic_load(&c->control->waiting)) {
+            futex(&c->control->seq, FUTEX_WAKE, 1);
+        }
+        return 0;
+    }
+    }
+}
+
+// Consumer side: take one message from any ring, 0 if they are all empty
+int ring_take(Channel *c, char *buf) {
+    for (int k = 0; k < c->lanes; k++) {
+        int l = (c->next_lane + k) % c->lanes;
+        Ring *r = &c->rings[l];
+        unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        if (head != atomic_load_explicit(&r->tail, memory_order_acquire)) {
+            memcpy(buf, c->slots + ((size_t)l * RING_SLOTS + head % RING_SLOTS) * c->size, c->size);
+            atomic_store_explicit(&r->head, head + 1, memory_order_release);
+            c->next_lane = l + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Consumer side: receive the next message of any producer
+int chan_recv(Channel *c, char *buf) {
+    switch (c->kind) {
+    case T_PIPE:
+    case T_STREAM: {
+        if (c->lanes == 1) {
+            return read_all(c->fds[0][0], buf, c->size);
+        }
+        struct pollfd pfds[MAX_PRODUCERS];
+        for (int l = 0; l < c->lanes; l++) {
+            pfds[l].fd = c->fds[l][0];
+            pfds[l].events = POLLIN;
+        }
+        if (poll(pfds, c->lanes, -1) <= 0) {
+            return -1;
+        }
+        for (int k = 0; k < c->lanes; k++) {
+            int l = (c->next_lane + k) % c->lanes;
+            if (pfds[l].revents & POLLIN) {
+                c->next_lane = l + 1;
+                return read_all(c->fds[l][0], buf, c->size); // The rest of the message is on its way
+            }
+        }
+        return -1;
+    }
+    case T_SEQPACKET:
+        return (recv(c->fds[0][0], buf, c->size, 0) == (ssize_t)c->size) ? 0 : -1;
+    case T_MQ:
+        return (mq_receive(c->mq, buf, c->size, NULL) == (ssize_t)c->size) ? 0 : -1;
+    case T_EVENTFD:
+        while (!ring_take(c, buf)) {
+            uint64_t count;
+            if (read(c->efd, &count, sizeof(count)) != sizeof(count)) { // Sleeps until a push
+                return -1;
+            }
+        }
+        return 0;
+    default:
+        while (!ring_take(c, buf)) {
+            atomic_store(&c->control->waiting, 1);
+            int seq = atomic_load(&c->control->seq);
+            if (ring_take(c, buf)) {
+                atomic_store(&c->control->waiting, 0);
+                return 0;
+            }
+            futex(&c->control->seq, FUTEX_WAIT, seq); // Returns at once if seq moved
+            atomic_store(&c->control->waiting, 0);
+        }
+        return 0;
+    }
+}
+
+// The first 8 bytes of every message: send time (ns since the cell started)
+// shifted left by 8, and the producer in the low byte
+void stamp(char *buf, uint64_t base, int producer) {
+    uint64_t word = ((now_ns() - base) << 8) | (uint64_t)producer;
+    memcpy(buf, &word, sizeof(word));
+}
+
+// Producer process: the latency phase with acks, then the throughput phase
+void producer(Channel *c, int p, int lanes_shared, int lat_n, int tput_n, uint64_t base, int ack_fd, int start_fd) {
+    char *buf = calloc(1, c->size);
+    char byte;
+    int lane = lanes_shared ? 0 : p;
+    for (int i = 0; i < lat_n; i++) {
+        stamp(buf, base, p);
+        if (chan_send(c, lane, buf) == -1 || read(ack_fd, &byte, 1) != 1) {
+            _exit(1);
+        }
+    }
+    if (read(start_fd, &byte, 1) != 1) {
+        _exit(1);
+    }
+    for (int i = 0; i < tput_n; i++) {
+        stamp(buf, base, p);
+        if (chan_send(c, lane, buf) == -1) {
+            _exit(1);
+        }
+    }
+    _exit(0);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Run one cell: transport, message size and number of producers
+void run_cell(const Transport *t, size_t size, int producers, long cell_bytes) {
+    static double latencies[LATENCY_SAMPLES];
+    Channel c;
+    int shared = (t->kind == T_SEQPACKET || t->kind == T_MQ);
+    int lanes = shared ? 1 : producers;
+    long tput_n = cell_bytes / size;
+    tput_n = (tput_n < MIN_MESSAGES) ? MIN_MESSAGES : (tput_n > MAX_MESSAGES) ? MAX_MESSAGES : tput_n;
+    tput_n -= tput_n % producers;
+    int lat_n = LATENCY_SAMPLES / producers;
+
+    printf("%-16s %9d %10zu", t->name, producers, size);
+    fflush(stdout);
+    if (chan_open(&c, t, size, lanes) == -1) {
+        printf(" %10s\n", "n/a");
+        chan_close(&c);
+        return;
+    }
+
+    int ack[MAX_PRODUCERS][2], start[2];
+    pid_t pids[MAX_PRODUCERS];
+    pipe(start);
+    uint64_t base = now_ns();
+    for (int p = 0; p < producers; p++) {
+        pipe(ack[p]);
+        if ((pids[p] = fork()) == 0) {
+            producer(&c, p, shared, lat_n, tput_n / producers, base, ack[p][0], start[0]);
+        }
+    }
+
+    char *buf = malloc(size);
+    int failed = 0;
+    int samples = 0;
+    for (int i = 0; i < lat_n * producers && !failed; i++) {
+        if (chan_recv(&c, buf) == -1) {
+            failed = 1;
+            break;
+        }
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        latencies[samples++] = ((now_ns() - base) - (word >> 8)) / 1e3;
+        write(ack[word & 0xff][1], "a", 1);
+    }
+
+    double t0 = now();
+    for (int p = 0; p < producers; p++) {
+        write(start[1], "s", 1);
+    }
+    for (long i = 0; i < tput_n && !failed; i++) {
+        if (chan_recv(&c, buf) == -1) {
+            failed = 1;
+        }
+    }
+    double seconds = now() - t0;
+
+    for (int p = 0; p < producers; p++) {
+        if (failed) kill(pids[p], SIGKILL);
+        waitpid(pids[p], NULL, 0);
+        close(ack[p][0]);
+        close(ack[p][1]);
+    }
+    close(start[0]);
+    close(start[1]);
+    free(buf);
+    chan_close(&c);
+
+    if (failed || samples == 0) {
+        printf(" %10s\n", "failed");
+        return;
+    }
+    qsort(latencies, samples, sizeof(double), compare_double);
+    printf(" %10.1f %10.1f %10.1f %12.0f %10.1f\n", latencies[samples / 2], latencies[(int)(samples * 0.99)],
+           latencies[samples - 1], tput_n / seconds, tput_n * (double)size / seconds / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 3) {
+        fprintf(stderr, "Usage: %s [producers] [MB per cell]\n", argv[0]);
+        return 1;
+    }
+    int many = (argc > 1) ? atoi(argv[1]) : 4;
+    long cell_mb = (argc > 2) ? atol(argv[2]) : 64;
+    if (many < 1 || many > MAX_PRODUCERS || cell_mb < 1) {
+        fprintf(stderr, "Producers must be 1-%d and the MB per cell positive\n", MAX_PRODUCERS);
+        return 1;
+    }
+
+    // Large mqueue messages need more than the default 800KB per user
+    struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+    setrlimit(RLIMIT_MSGQUEUE, &rl);
+    signal(SIGPIPE, SIG_IGN);
+
+    Transport transports[] = {
+        { "pipe", T_PIPE, 0 },
+        { "pipe 256KB", T_PIPE, 256 * 1024 },
+        { "pipe 1MB", T_PIPE, 1024 * 1024 },
+        { "socket stream", T_STREAM, 0 },
+        { "socket seqpkt", T_SEQPACKET, 0 },
+        { "mqueue", T_MQ, 0 },
+        { "eventfd+ring", T_EVENTFD, 0 },
+        { "futex+ring", T_FUTEX, 0 },
+    };
+
+    printf("One-way latency (us) with one message in flight per producer, then throughput\n");
+    printf("with every producer sending as fast as it can, %ld MB or %d-%d messages per cell\n\n",
+           cell_mb, MIN_MESSAGES, MAX_MESSAGES);
+    printf("%-16s %9s %10s %10s %10s %10s %12s %10s\n", "transport", "producers", "msg bytes",
+           "p50", "p99", "max", "msgs/s", "MB/s");
+    int counts[2] = { 1, many };
+    for (size_t k = 0; k < sizeof(transports) / sizeof(transports[0]); k++) {
+        for (int m = 0; m < ((many > 1) ? 2 : 1); m++) {
+            for (size_t size = MIN_MSG; size <= MAX_MSG; size *= MSG_STEP) {
+                run_cell(&transports[k], size, counts[m], cell_mb << 20);
+            }
+            // 8 * 8^6 = 2 MB, so close the range with exactly 1 MB
+            run_cell(&transports[k], MAX_MSG, counts[m], cell_mb << 20);
+        }
+        printf("\n");
+    }
+    return 0;
+}
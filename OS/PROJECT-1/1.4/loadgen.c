@@ -0,0 +1,380 @@
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include "../search.h"
+
+// Non-interactive client for the dispatcher: starts it like the frontend does,
+// sends a scripted or random stream of add/remove/progress/status commands at
+// a fixed rate, times every command and at the end checks that the total is
+// the exact count of the file. Output is JSON, one object per line.
+//
+// Usage: ./loadgen <input file> <search string> [options]
+//   --rate N        commands per second (default 20)
+//   --duration S    seconds of random commands (default 10)
+//   --script FILE   commands from FILE instead, one per line ("sleep <ms>" waits)
+//   --max-workers N random stream keeps 1..N workers (default 8)
+//   --seed N        seed of the random stream
+//   --settle S      seconds to wait for the scan to finish at the end (default 120)
+//
+// add and remove have no answer of their own, so each one is followed by a
+// "progress" and its latency is the time until that answer arrives.
+// The worker sleeps 10-12 s per chunk for the demo, so benchmarks need one
+// built without it, next to the dispatcher:
+//   gcc -O2 -DNO_DEMO_SLEEP -o worker worker.c -lz
+
+#define MAX_PENDING 1024 // Commands sent and not answered yet
+#define MAX_SAMPLES 100000 // Latencies kept per command
+#define LINE_MAX_LEN 1024
+
+// A command waiting for its answer
+typedef struct {
+    int kind; // Index in command_names
+    double sent;
+} Pending;
+
+const char *command_names[] = { "add", "remove", "progress", "status" };
+#define NKINDS 4
+
+int dispatcher_pid;
+int command_fd; // Commands to the dispatcher
+int response_fd; // Its answers
+
+Pending pending[MAX_PENDING];
+int pending_head = 0, pending_count = 0;
+double *latencies[NKINDS];
+int latency_count[NKINDS];
+
+int workers = 0; // Workers added and not removed
+long last_total = -1; // From the last progress answer
+double last_percent = 0;
+int status_lines_left = 0; // Worker lines still expected for a status answer
+
+char line_buf[LINE_MAX_LEN];
+int line_len = 0;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Exact number of (overlapping) matches in the file, the reference for the check
+// Returns -1 for the modes that are not a plain search string or a byte class
+long reference_count(const char *path, const char *arg) {
+    char needle[MAX_NEEDLE];
+    int n = 0;
+    static ByteClass byte_class;
+    int class_mode = (parse_byte_class(arg, &byte_class) == 0); // Counted with the table, not the SIMD path
+    if (arg[0] == '@' || strcmp(arg, "--wc") == 0 || is_utf8_arg(arg)) {
+        return -1;
+    }
+    if (!class_mode && (n = unescape_needle(arg, needle)) == -1) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    long count = 0;
+    if (st.st_size > 0) {
+        const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        const char *p = map, *end = map + st.st_size;
+        for (long i = 0; class_mode && i < st.st_size; i++) {
+            count += byte_class.member[(unsigned char)map[i]];
+        }
+        while (!class_mode && (p = memmem(p, end - p, needle, n)) != NULL) {
+            count++;
+            p++;
+        }
+        munmap((void *)map, st.st_size);
+    }
+    close(fd);
+    return count;
+}
+
+// Send one line to the dispatcher and remember what answer to wait for
+void send_command(const char *cmd, int kind) {
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "%s\n", cmd);
+    if (kind == 0 || kind == 1) {
+        len += snprintf(msg + len, sizeof(msg) - len, "progress\n"); // Barrier for the answer
+    }
+    if (pending_count == MAX_PENDING) {
+        fprintf(stderr, "[LOADGEN] Too many commands without an answer\n");
+        return;
+    }
+    double t = now_seconds();
+    if (write(command_fd, msg, len) != len) {
+        perror("[LOADGEN] Failed to send command");
+        return;
+    }
+    pending[(pending_head + pending_count) % MAX_PENDING].kind = kind;
+    pending[(pending_head + pending_count) % MAX_PENDING].sent = t;
+    pending_count++;
+}
+
+// The oldest pending command got its answer
+void answered(double t) {
+    if (pending_count == 0) {
+        return; // A progress of our own at the end
+    }
+    Pending *p = &pending[pending_head];
+    double latency = t - p->sent;
+    if (latency_count[p->kind] < MAX_SAMPLES) {
+        latencies[p->kind][latency_count[p->kind]++] = latency;
+    }
+    printf("{\"event\":\"command\",\"cmd\":\"%s\",\"latency_us\":%.1f,\"workers\":%d,\"progress\":%.2f}\n",
+           command_names[p->kind], latency * 1e6, workers, last_percent);
+    pending_head = (pending_head + 1) % MAX_PENDING;
+    pending_count--;
+}
+
+// Handle one line from the dispatcher; other messages (printf of the dispatcher) are skipped
+void handle_line(const char *line, double t) {
+    if (status_lines_left > 0 && strncmp(line, "    [WORKER", 11) == 0) {
+        if (--status_lines_left == 0) {
+            answered(t);
+        }
+        return;
+    }
+    int n;
+    if (strncmp(line, "[DISPATCHER] Progress:", 22) == 0) {
+        sscanf(line, "[DISPATCHER] Progress: %lf%%, Characters found so far: %ld", &last_percent, &last_total);
+        answered(t);
+    }
+    else if (sscanf(line, "[DISPATCHER] PID %*d, %d workers", &n) == 1) {
+        status_lines_left = n;
+        if (n == 0) {
+            answered(t);
+        }
+    }
+}
+
+// Read what the dispatcher wrote, waiting at most timeout seconds
+void poll_responses(double timeout) {
+    fd_set readfds;
+    struct timeval tv = { (long)timeout, (long)((timeout - (long)timeout) * 1e6) };
+    FD_ZERO(&readfds);
+    FD_SET(response_fd, &readfds);
+    if (select(response_fd + 1, &readfds, NULL, NULL, &tv) <= 0) {
+        return;
+    }
+    char buffer[4096];
+    ssize_t bytes = read(response_fd, buffer, sizeof(buffer));
+    double t = now_seconds();
+    for (ssize_t k = 0; k < bytes; k++) {
+        if (buffer[k] == '\n' || line_len == LINE_MAX_LEN - 1) {
+            line_buf[line_len] = '\0';
+            handle_line(line_buf, t);
+            line_len = 0;
+        }
+        else {
+            line_buf[line_len++] = buffer[k];
+        }
+    }
+}
+
+// Wait until the time t, reading answers meanwhile
+void wait_until(double t) {
+    double left;
+    while ((left = t - now_seconds()) > 0) {
+        poll_responses(left);
+    }
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Next command of the random stream, keeping 1..max_workers workers
+int random_command(int max_workers) {
+    int r = rand() % 100;
+    if (workers == 0 || (r < 30 && workers < max_workers)) return 0;
+    if (r < 50 && workers > 1) return 1;
+    if (r < 80) return 2;
+    return 3;
+}
+
+int kind_of(const char *cmd) {
+    for (int k = 0; k < NKINDS; k++) {
+        if (strcmp(cmd, command_names[k]) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+void run_command(int kind) {
+    if (kind == 0) workers++;
+    if (kind == 1) workers--;
+    send_command(command_names[kind], kind);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <input file> <search string> [--rate N] [--duration S] [--script FILE] [--max-workers N] [--seed N] [--settle S]\n", argv[0]);
+        return 1;
+    }
+    const char *input_file = argv[1];
+    const char *character = argv[2];
+    double rate = 20, duration = 10, settle = 120;
+    int max_workers = 8;
+    unsigned seed = time(NULL) ^ getpid();
+    const char *script = NULL;
+    for (int k = 3; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "--rate") == 0) rate = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "--duration") == 0) duration = atof(argv[k + 1]);
+        else if (strcmp(argv[k], "--script") == 0) script = argv[k + 1];
+        else if (strcmp(argv[k], "--max-workers") == 0) max_workers = atoi(argv[k + 1]);
+        else if (strcmp(argv[k], "--seed") == 0) seed = strtoul(argv[k + 1], NULL, 10);
+        else if (strcmp(argv[k], "--settle") == 0) settle = atof(argv[k + 1]);
+        else {
+            fprintf(stderr, "[LOADGEN] Unknown option %s\n", argv[k]);
+            return 1;
+        }
+    }
+    if (rate <= 0 || max_workers < 1) {
+        fprintf(stderr, "[LOADGEN] The rate and the worker limit must be positive\n");
+        return 1;
+    }
+    srand(seed);
+    for (int k = 0; k < NKINDS; k++) {
+        latencies[k] = malloc(sizeof(double) * MAX_SAMPLES);
+        if (latencies[k] == NULL) {
+            perror("[LOADGEN] malloc failed");
+            return 1;
+        }
+    }
+    long expected = reference_count(input_file, character);
+
+    // Start the dispatcher exactly like the frontend does
+    int cmd_pipe[2], response_pipe[2];
+    if (pipe(cmd_pipe) == -1 || pipe(response_pipe) == -1) {
+        perror("[LOADGEN] Pipe creation failed");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("[LOADGEN] Fork failed");
+        return 1;
+    }
+    if (pid == 0) {
+        dup2(cmd_pipe[0], STDIN_FILENO);
+        dup2(response_pipe[1], STDOUT_FILENO);
+        close(cmd_pipe[1]);
+        close(response_pipe[0]);
+        char response_fd_str[16];
+        snprintf(response_fd_str, sizeof(response_fd_str), "%d", response_pipe[1]);
+        execl("./dispatcher", "dispatcher", input_file, character, response_fd_str, NULL);
+        perror("[LOADGEN] Exec dispatcher failed");
+        exit(1);
+    }
+    dispatcher_pid = pid;
+    command_fd = cmd_pipe[1];
+    response_fd = response_pipe[0];
+    close(cmd_pipe[0]);
+    close(response_pipe[1]);
+    signal(SIGPIPE, SIG_IGN);
+
+    // The command stream
+    double interval = 1.0 / rate;
+    double start = now_seconds();
+    double next = start;
+    if (script != NULL) {
+        FILE *fp = fopen(script, "r");
+        char cmd[128];
+        if (fp == NULL) {
+            perror("[LOADGEN] Failed to open the script");
+            kill(dispatcher_pid, SIGTERM);
+            return 1;
+        }
+        while (fgets(cmd, sizeof(cmd), fp) != NULL) {
+            cmd[strcspn(cmd, "\n")] = '\0';
+            int ms;
+            if (sscanf(cmd, "sleep %d", &ms) == 1) {
+                next += ms / 1000.0;
+                continue;
+            }
+            int kind = kind_of(cmd);
+            if (kind == -1) {
+                if (cmd[0] != '\0' && cmd[0] != '#') fprintf(stderr, "[LOADGEN] Skipping unknown command \"%s\"\n", cmd);
+                continue;
+            }
+            wait_until(next);
+            run_command(kind);
+            next += interval;
+        }
+        fclose(fp);
+    }
+    else {
+        while (next < start + duration) {
+            wait_until(next);
+            run_command(random_command(max_workers));
+            next += interval;
+        }
+    }
+
+    // Let the scan finish with the workers left (at least one), then check the total
+    if (workers == 0) {
+        run_command(0);
+    }
+    double deadline = now_seconds() + settle;
+    while (now_seconds() < deadline && (pending_count > 0 || last_percent < 100.0)) {
+        if (pending_count == 0) {
+            send_command("progress", 2);
+        }
+        wait_until(now_seconds() + 0.1);
+    }
+    double total_time = now_seconds() - start;
+    if (last_percent < 100.0) {
+        fprintf(stderr, "[LOADGEN] The scan did not finish in %.0f s (%.2f%% done): the total is partial and the latencies\n"
+                        "          may only measure the demo sleep, build the worker with -DNO_DEMO_SLEEP or raise --settle\n",
+                settle, last_percent);
+    }
+
+    kill(dispatcher_pid, SIGTERM);
+    waitpid(dispatcher_pid, NULL, 0);
+    close(command_fd);
+    close(response_fd);
+
+    // Summary: latency percentiles per command and the exactness check
+    printf("{\"event\":\"summary\",\"seconds\":%.3f,\"finished\":%s,\"total\":%ld,", total_time,
+           (last_percent >= 100.0) ? "true" : "false", last_total);
+    if (expected >= 0) {
+        printf("\"expected\":%ld,\"exact\":%s,", expected, (last_total == expected) ? "true" : "false");
+    }
+    else {
+        printf("\"expected\":null,\"exact\":null,");
+    }
+    printf("\"latency_us\":{");
+    for (int k = 0; k < NKINDS; k++) {
+        int n = latency_count[k];
+        qsort(latencies[k], n, sizeof(double), compare_double);
+        printf("%s\"%s\":{\"count\":%d", (k > 0) ? "," : "", command_names[k], n);
+        if (n > 0) {
+            printf(",\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f", latencies[k][n / 2] * 1e6,
+                   latencies[k][(int)(n * 0.99)] * 1e6, latencies[k][n - 1] * 1e6);
+        }
+        printf("}");
+    }
+    printf("}}\n");
+
+    return (expected >= 0 && last_total != expected) ? 2 : 0;
+}
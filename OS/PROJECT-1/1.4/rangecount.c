@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../search.h"
+#include "formats.h"
+
+// Range counts from the index the dispatcher writes with "index <path> [block KB]"
+// Both the index and the input file are memory-mapped. The count of a range is
+// two lookups in the cumulative counts plus a scan of at most one block at
+// each end, so repeated queries cost microseconds instead of a full pass.
+//
+// Usage: ./rangecount <index file> <input file> [start end [class]]
+// Without a range, "start end [class]" lines are read from stdin (the class is the rest of the line).
+// A match counts if it lies entirely inside [start, end).
+//
+// The index counts what its job searched for: a substring, or a "[...]" byte
+// class. A class job run with "rank" before the first add keeps one column per
+// byte of the class, and a query may then name any part of it, "[e]" or
+// "[aeiou]" out of a "[a-z]" index: count(c, start, end). Without "rank", and for
+// a substring, a query counts the job's search only; anything else needs another
+// job and another index.
+
+const IndexHeader *header;
+ByteClass index_class; // Parsed from the header of a byte class index
+int match_len; // 1 for a byte class, else the substring length
+const long *cumulative; // blocks + 1 rows of header->columns entries
+const char *data; // The input file
+long data_size;
+
+// What one query counts: the index columns it adds up, and the bytes for the scans at the ends
+typedef struct {
+    ByteClass bc;
+    int columns[256];
+    int ncolumns;
+} Query;
+
+// Matches of the query that start before offset x: the cumulative counts of
+// its block plus the ones that start between the block and x
+long starts_before(const Query *q, long x) {
+    int n = match_len;
+    if (x <= 0) {
+        return 0;
+    }
+    long k = (x >= data_size) ? header->blocks : x / header->block_size;
+    long count = 0;
+    for (int c = 0; c < q->ncolumns; c++) {
+        count += cumulative[k * header->columns + q->columns[c]];
+    }
+    if (x >= data_size) {
+        return count;
+    }
+    long from = k * header->block_size;
+    long to = x + n - 1; // A match starting at x - 1 ends here
+    if (to > data_size) {
+        to = data_size;
+    }
+    if (header->is_class) {
+        return count + class_counter(data + from, to - from, &q->bc);
+    }
+    return count + substr_counter(data + from, to - from, header->needle, n);
+}
+
+// Matches that lie entirely inside [start, end)
+long range_count(const Query *q, long start, long end) {
+    long last = end - match_len + 1; // One past the last start that fits
+    if (last <= start) {
+        return 0;
+    }
+    return starts_before(q, last) - starts_before(q, start);
+}
+
+// Set up a query for a class argument, or for the whole search of the index (NULL)
+// Returns -1 if the index cannot count it
+int make_query(const char *arg, Query *q) {
+    q->ncolumns = 0;
+    if (arg == NULL) {
+        q->bc = index_class;
+        for (int m = 0; m < header->columns; m++) {
+            q->columns[q->ncolumns++] = m;
+        }
+        return 0;
+    }
+    if (!header->is_class || parse_byte_class(arg, &q->bc) == -1) {
+        fprintf(stderr, "%s: the index only counts its own search string\n", arg);
+        return -1;
+    }
+    int column = 0, whole = 1;
+    for (int b = 0; b < 256; b++) {
+        if (q->bc.member[b] && !index_class.member[b]) {
+            fprintf(stderr, "%s: byte 0x%02x is not in the class of the index\n", arg, b);
+            return -1;
+        }
+        whole &= (q->bc.member[b] == index_class.member[b]);
+        if (q->bc.member[b]) {
+            q->columns[q->ncolumns++] = column;
+        }
+        column += index_class.member[b];
+    }
+    if (whole) {
+        return make_query(NULL, q);
+    }
+    if (header->columns == 1) {
+        fprintf(stderr, "%s: the index has no per-byte counts, build it after \"rank\"\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+// Map a whole file read-only, returns NULL on error
+void *map_file(const char *path, struct stat *st) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, st) == -1) {
+        perror(path);
+        return NULL;
+    }
+    void *map = (st->st_size > 0) ? mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED || map == NULL) {
+        fprintf(stderr, "Failed to map %s\n", path);
+        return NULL;
+    }
+    return map;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void query(long start, long end, const char *arg) {
+    static Query q;
+    if (start < 0 || end < start) {
+        fprintf(stderr, "Bad range %ld-%ld\n", start, end);
+        return;
+    }
+    if (make_query(arg, &q) == -1) {
+        return;
+    }
+    double t0 = now_seconds();
+    long count = range_count(&q, start, end);
+    double t1 = now_seconds();
+    printf("[RANGE] %ld-%ld%s%s: %ld matches (%.1f us)\n", start, end, arg ? " " : "", arg ? arg : "", count, (t1 - t0) * 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 5 && argc != 6) {
+        fprintf(stderr, "Usage: %s <index file> <input file> [start end [class]]\n", argv[0]);
+        return 1;
+    }
+
+    struct stat index_st, data_st;
+    header = map_file(argv[1], &index_st);
+    if (header == NULL) {
+        return 1;
+    }
+    if (index_st.st_size < (off_t)sizeof(IndexHeader) || memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+        || header->block_size <= 0 || header->needle_len <= 0 || header->needle_len > MAX_NEEDLE
+        || header->columns < 1 || header->columns > 256
+        || index_st.st_size != (off_t)(sizeof(IndexHeader) + sizeof(long) * (header->blocks + 1) * header->columns)) {
+        fprintf(stderr, "%s is not a range index\n", argv[1]);
+        return 1;
+    }
+    cumulative = (const long *)(header + 1);
+    match_len = header->needle_len;
+    if (header->is_class) {
+        char arg[MAX_NEEDLE + 1];
+        memcpy(arg, header->needle, header->needle_len);
+        arg[header->needle_len] = '\0';
+        if (parse_byte_class(arg, &index_class) == -1) {
+            fprintf(stderr, "%s has a bad byte class\n", argv[1]);
+            return 1;
+        }
+        match_len = 1;
+    }
+
+    if (header->file_size == 0) {
+        data = NULL;
+        data_size = 0;
+    }
+    else if ((data = map_file(argv[2], &data_st)) == NULL) {
+        return 1;
+    }
+    else {
+        data_size = data_st.st_size;
+        // The index is only good for the file as it was counted
+        if (data_size != header->file_size || data_st.st_mtim.tv_sec != header->mtime_sec
+            || data_st.st_mtim.tv_nsec != header->mtime_nsec) {
+            fprintf(stderr, "%s changed since the index was written, build it again\n", argv[2]);
+            return 1;
+        }
+        madvise((void *)data, data_size, MADV_RANDOM); // Only the blocks at the ends are read
+    }
+
+    if (argc >= 5) {
+        query(atol(argv[3]), atol(argv[4]), (argc == 6) ? argv[5] : NULL);
+        return 0;
+    }
+    char line[1024];
+    long start, end;
+    int used;
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (sscanf(line, "%ld %ld %n", &start, &end, &used) >= 2) {
+            char *arg = line + used; // The rest of the line, so a class may hold a space
+            arg[strcspn(arg, "\n")] = '\0';
+            query(start, end, (*arg != '\0') ? arg : NULL);
+        }
+    }
+    return 0;
+}
@@ -1,35 +1,1027 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <zlib.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#include "../search.h"
+#include "formats.h"
 
 #define BUFFER_SIZE 1024
+#define MAX_GROUP_FANOUT 64 // Children of one sub-dispatcher
+#define GROUP_MIN_PIECE 1024 // Smallest piece a sub-dispatcher hands to a child
+#define RESULT_FIELDS (MAX_PATTERNS + 16) // Numbers in one result line
+#define GZ_CHUNK 65536 // Compressed bytes read at a time
+#define THROTTLE_BURST_MS 100 // Reads allowed ahead of the rate, at most
+#define IOPRIO_CLASS_IDLE 3 // From linux/ioprio.h, glibc has no wrapper
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
 
-int buf_counter(char *buffer, ssize_t len, char c2c) {
-    int count = 0;
-    for (ssize_t i = 0; i < len; i++) {
-        if (buffer[i] == c2c) {
-            count++;
+// Set by SIGUSR1 when the dispatcher cancels the job: the reading loops stop
+// at the next buffer and the chunk is answered with "cancelled"
+volatile sig_atomic_t cancelled = 0;
+
+// Children of a sub-dispatcher ("--group"), the cancel is passed down to them
+pid_t group_pids[MAX_GROUP_FANOUT];
+volatile sig_atomic_t group_size = 0;
+
+void handle_cancel(int sig) {
+    (void)sig;
+    cancelled = 1;
+    for (int k = 0; k < group_size; k++) {
+        kill(group_pids[k], SIGUSR1);
+    }
+}
+
+// Aho-Corasick automaton for the multi-pattern mode, compiled into a full DFA
+// Bytes that appear in no pattern share one input class, so each state row
+// only has nclasses entries instead of 256 and the table stays in cache
+typedef struct {
+    int nstates;
+    int nclasses;
+    unsigned char class_of[256]; // Byte -> input class
+    int *delta; // nstates x nclasses transition table
+    int *fail; // Failure link of each state
+    int *out_link; // Nearest accepting state on the failure chain (-1 = none)
+    int *term_len; // Pattern length of an accepting state (0 = not accepting)
+    int *bfs_order; // States in BFS order, used to fold the hits along the failure links
+    int *hits; // Per-chunk visits of each state
+    int *tail_hits; // Per-chunk matches found in the overlap past the chunk
+    int npatterns;
+    int pattern_state[MAX_PATTERNS]; // Accepting state of each pattern
+    int duplicate_of[MAX_PATTERNS]; // Earlier pattern with the same text (-1 = none), left out of the total
+    int max_len; // Longest pattern, decides the overlap
+} Automaton;
+
+// Index of a ".gz" input, memory-mapped, NULL for a plain file (linked with -lz)
+// Only the point a chunk starts from is ever touched
+const GzIndexHeader *gz_index;
+const GzPoint *gz_points;
+
+// Map the index the dispatcher built for a ".gz" input: its memfd if it had to
+// keep it in memory, else the first valid one of the places it tries too
+// Returns -1 if it is missing or not for this file
+int load_gz_index(const char *input_file, struct stat *input_st) {
+    char path[4096];
+    const char *env = getenv(GZ_INDEX_FD_ENV);
+    if (env != NULL) {
+        gz_index = map_gz_index_fd(atoi(env), input_st);
+    }
+    for (int k = 0; gz_index == NULL && k < GZ_INDEX_PLACES; k++) {
+        if (gz_index_path(input_file, input_st, k, path, sizeof(path)) == -1) {
+            continue;
+        }
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            gz_index = map_gz_index_fd(fd, input_st);
+            close(fd);
+        }
+    }
+    if (gz_index == NULL) {
+        return -1;
+    }
+    gz_points = (const GzPoint *)(gz_index + 1);
+    return 0;
+}
+
+// Read rate limit shared with the dispatcher and the other workers (Throttle
+// in formats.h). NULL = no limit (no memfd from the dispatcher)
+Throttle *throttle;
+int throttle_generation = 0; // Priority generation this worker has applied
+
+// Map the bucket from the memfd the dispatcher passed down
+// Done before the zygote and the sub-dispatchers fork, so the mapping is inherited
+void map_throttle() {
+    const char *env = getenv(THROTTLE_ENV);
+    if (env == NULL) {
+        return;
+    }
+    int fd = atoi(env);
+    void *map = mmap(NULL, sizeof(Throttle), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("[WORKER] No shared throttle");
+        return;
+    }
+    throttle = map;
+}
+
+// Take the tokens for a read of bytes, sleeping until the bucket allows it
+// A cancel stops the wait, the chunk is thrown away anyway
+void throttle_take(long bytes) {
+    long rate = (throttle != NULL) ? __atomic_load_n(&throttle->rate, __ATOMIC_RELAXED) : 0;
+    if (rate <= 0) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long now = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    long cost = (long)(bytes * 1e9 / rate);
+    long empty = __atomic_load_n(&throttle->empty_ns, __ATOMIC_RELAXED);
+    long next;
+    do {
+        next = ((empty > now) ? empty : now) + cost; // A full bucket does not save up more than the burst
+    } while (!__atomic_compare_exchange_n(&throttle->empty_ns, &empty, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    long wake = next - THROTTLE_BURST_MS * 1000000L;
+    if (wake <= now) {
+        return;
+    }
+    ts.tv_sec = wake / 1000000000L;
+    ts.tv_nsec = wake % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !cancelled) {
+    }
+}
+
+// read() of the input, under the shared rate limit
+// The job of a gzip input is a memfd: its disk reads were taken in gz_open_range
+ssize_t throttled_read(int fd, void *buf, size_t count) {
+    if (gz_index == NULL) {
+        throttle_take(count);
+    }
+    return read(fd, buf, count);
+}
+
+// Apply the I/O class and nice value set with "throttle", once per change
+// Lowering the nice value again needs CAP_SYS_NICE, without it the worker stays lower
+void apply_priority() {
+    if (throttle == NULL) {
+        return;
+    }
+    int generation = __atomic_load_n(&throttle->generation, __ATOMIC_ACQUIRE);
+    if (generation == throttle_generation) {
+        return;
+    }
+    throttle_generation = generation;
+    int ioprio = throttle->io_idle ? (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) : 0; // 0 = from the nice value
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1) {
+        perror("[WORKER] ioprio_set failed");
+    }
+    if (setpriority(PRIO_PROCESS, 0, throttle->nice) == -1) {
+        perror("[WORKER] setpriority failed");
+    }
+}
+
+// Decompress the uncompressed range [offset, offset + len) of a gzip input into
+// a memfd and return it at position 0, so every mode reads it like the plain file
+// Inflate starts at the last access point before the range: the bits of the
+// byte before it are primed and its window is the dictionary. Later gzip
+// members are followed by skipping the 8-byte trailer and parsing their header
+// Returns -1 on error
+int gz_open_range(const char *input_file, long offset, long len) {
+    static unsigned char input[GZ_CHUNK], output[GZ_CHUNK];
+    long lo = 0, hi = gz_index->points - 1;
+    while (lo < hi) { // Last point with out <= offset
+        long mid = (lo + hi + 1) / 2;
+        if (gz_points[mid].out <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    const GzPoint *point = &gz_points[lo];
+
+    int fd = open(input_file, O_RDONLY);
+    int out_fd = memfd_create("gz-range", 0);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (fd == -1 || out_fd == -1 || inflateInit2(&strm, -15) != Z_OK) {
+        if (fd != -1) close(fd);
+        if (out_fd != -1) close(out_fd);
+        return -1;
+    }
+    int ret = Z_OK;
+    if (lseek(fd, point->in - (point->bits ? 1 : 0), SEEK_SET) == (off_t)-1) {
+        ret = Z_ERRNO;
+    }
+    if (ret == Z_OK && point->bits) {
+        unsigned char byte;
+        if (read(fd, &byte, 1) != 1) {
+            ret = Z_ERRNO;
+        }
+        else {
+            inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+        }
+    }
+    if (ret == Z_OK) {
+        inflateSetDictionary(&strm, point->window, GZ_WINDOW);
+    }
+
+    long skip = offset - point->out; // Output before the range is thrown away
+    int trailer = 0; // Trailer bytes of a finished member still to skip
+    int raw = 1; // Still in the member of the access point, without its gzip wrapper
+    while (ret == Z_OK && len > 0 && !cancelled) {
+        if (strm.avail_in == 0) {
+            throttle_take(sizeof(input));
+            ssize_t n = read(fd, input, sizeof(input));
+            if (n <= 0) {
+                break; // End of the file (or error): the range was past the data
+            }
+            strm.next_in = input;
+            strm.avail_in = n;
+        }
+        if (trailer > 0) {
+            int step = ((int)strm.avail_in < trailer) ? (int)strm.avail_in : trailer;
+            strm.next_in += step;
+            strm.avail_in -= step;
+            if ((trailer -= step) == 0) {
+                inflateReset2(&strm, 47); // Next member, with its gzip header
+                raw = 0;
+            }
+            continue;
+        }
+        strm.next_out = output;
+        strm.avail_out = sizeof(output);
+        int status = inflate(&strm, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            ret = status;
+            break;
+        }
+        long have = sizeof(output) - strm.avail_out;
+        long from = (skip < have) ? skip : have;
+        skip -= from;
+        long keep = (have - from < len) ? have - from : len;
+        if (keep > 0 && write(out_fd, output + from, keep) != keep) {
+            ret = Z_ERRNO;
+        }
+        len -= keep;
+        if (status == Z_STREAM_END) {
+            if (raw) {
+                trailer = 8; // The raw stream leaves the CRC32 and size of the member
+            }
+            else {
+                inflateReset(&strm); // The gzip wrapper read the trailer already
+            }
+        }
+    }
+    inflateEnd(&strm);
+    close(fd);
+    if (ret != Z_OK || lseek(out_fd, 0, SEEK_SET) == (off_t)-1) {
+        close(out_fd);
+        return -1;
+    }
+    return out_fd;
+}
+
+// Add the count of every byte of the buffer to counts (rank mode of a byte class)
+// Four tables, so consecutive equal bytes do not wait on the same counter
+// Returns the number of bytes in the class
+long class_histogram(const char *buffer, ssize_t len, const ByteClass *bc, long *counts) {
+    static unsigned table[4][256];
+    memset(table, 0, sizeof(table));
+    const unsigned char *p = (const unsigned char *)buffer;
+    ssize_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        table[0][p[i]]++;
+        table[1][p[i + 1]]++;
+        table[2][p[i + 2]]++;
+        table[3][p[i + 3]]++;
+    }
+    for (; i < len; i++) {
+        table[0][p[i]]++;
+    }
+    long total = 0;
+    for (int b = 0; b < 256; b++) {
+        if (bc->member[b]) {
+            long n = table[0][b] + table[1][b] + table[2][b] + table[3][b];
+            counts[b] += n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+// Match offsets of one chunk (offsets mode), as text: " d1 d2 ..." where every
+// delta is the distance from the match before, the first from the chunk offset
+typedef struct {
+    char *text;
+    int len;
+    int size;
+} OffsetList;
+
+// Append the offset of every match that lies fully inside the buffer to the list
+// base is the file offset of buffer[0], *last the offset of the previous match
+// memchr finds the candidates for the first byte, memcmp checks the rest
+void substr_offsets(const char *buffer, ssize_t len, const char *needle, int n, long base, long *last, OffsetList *list) {
+    const char *p = buffer;
+    const char *end = buffer + len - n + 1; // One past the last start that fits
+    while (p < end && (p = memchr(p, needle[0], end - p)) != NULL) {
+        if (memcmp(p + 1, needle + 1, n - 1) == 0) {
+            if (list->len + 24 > list->size) {
+                int size = (list->size > 0) ? list->size * 2 : 4096;
+                char *text = realloc(list->text, size);
+                if (text == NULL) {
+                    perror("[WORKER] Offset list allocation failed");
+                    exit(1);
+                }
+                list->text = text;
+                list->size = size;
+            }
+            long offset = base + (p - buffer);
+            list->len += snprintf(list->text + list->len, 24, " %ld", offset - *last);
+            *last = offset;
         }
+        p++;
+    }
+}
+
+// Load one pattern per line from the file (escapes allowed, empty lines skipped)
+// and compile the set into the automaton
+// Returns -1 on error, with the reason in *error
+int build_automaton(const char *path, Automaton *ac, const char **error) {
+    static PatternSet set;
+    int total_len = 0;
+
+    if (read_pattern_set(path, &set) == -1) {
+        *error = set.error;
+        return -1;
+    }
+    ac->npatterns = set.count;
+    ac->max_len = 0;
+    for (int p = 0; p < set.count; p++) {
+        ac->duplicate_of[p] = set.duplicate_of[p];
+        total_len += set.len[p];
+        if (set.len[p] > ac->max_len) {
+            ac->max_len = set.len[p];
+        }
+    }
+    // Input classes: 0 for every byte not used by any pattern
+    memset(ac->class_of, 0, sizeof(ac->class_of));
+    ac->nclasses = 1;
+    for (int p = 0; p < ac->npatterns; p++) {
+        for (int k = 0; k < set.len[p]; k++) {
+            unsigned char b = set.text[p][k];
+            if (ac->class_of[b] == 0) {
+                ac->class_of[b] = ac->nclasses++;
+            }
+        }
+    }
+
+    int max_states = total_len + 1;
+    ac->delta = malloc(sizeof(int) * max_states * ac->nclasses);
+    ac->fail = calloc(max_states, sizeof(int));
+    ac->out_link = malloc(sizeof(int) * max_states);
+    ac->term_len = calloc(max_states, sizeof(int));
+    ac->bfs_order = malloc(sizeof(int) * max_states);
+    ac->hits = calloc(max_states, sizeof(int));
+    ac->tail_hits = calloc(max_states, sizeof(int));
+    if (!ac->delta || !ac->fail || !ac->out_link || !ac->term_len || !ac->bfs_order || !ac->hits || !ac->tail_hits) {
+        *error = "out of memory";
+        return -1;
+    }
+    for (int i = 0; i < max_states * ac->nclasses; i++) {
+        ac->delta[i] = -1;
+    }
+
+    // Trie of the patterns
+    ac->nstates = 1;
+    for (int p = 0; p < ac->npatterns; p++) {
+        int state = 0;
+        for (int k = 0; k < set.len[p]; k++) {
+            int *next = &ac->delta[state * ac->nclasses + ac->class_of[(unsigned char)set.text[p][k]]];
+            if (*next == -1) {
+                *next = ac->nstates++;
+            }
+            state = *next;
+        }
+        ac->term_len[state] = set.len[p];
+        ac->pattern_state[p] = state;
+    }
+
+    // BFS: failure links, and the missing transitions taken from the failure state
+    int head = 0, tail = 0;
+    ac->out_link[0] = -1;
+    for (int c = 0; c < ac->nclasses; c++) {
+        int t = ac->delta[c];
+        if (t == -1) {
+            ac->delta[c] = 0;
+        }
+        else {
+            ac->fail[t] = 0;
+            ac->bfs_order[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        int s = ac->bfs_order[head++];
+        ac->out_link[s] = ac->term_len[s] ? s : ac->out_link[ac->fail[s]];
+        for (int c = 0; c < ac->nclasses; c++) {
+            int t = ac->delta[s * ac->nclasses + c];
+            int via_fail = ac->delta[ac->fail[s] * ac->nclasses + c];
+            if (t == -1) {
+                ac->delta[s * ac->nclasses + c] = via_fail;
+            }
+            else {
+                ac->fail[t] = via_fail;
+                ac->bfs_order[tail++] = t;
+            }
+        }
+    }
+    return 0;
+}
+
+// Scan one chunk with the automaton and fill the per-pattern counts
+// Inside the chunk every byte only bumps the hit counter of the current state;
+// the counts are recovered at the end by folding the hits along the failure
+// links. In the overlap past the chunk only matches that start inside it count.
+// Returns -1 on read error
+int scan_patterns(Automaton *ac, int job_fd, int length, off_t to_read, long *counts) {
+    unsigned char buffer[BUFFER_SIZE];
+    int state = 0;
+    off_t pos = 0; // Position relative to the chunk start
+    ssize_t rfile;
+
+    memset(ac->hits, 0, sizeof(int) * ac->nstates);
+    memset(ac->tail_hits, 0, sizeof(int) * ac->nstates);
+
+    while (to_read > 0 && !cancelled) {
+        int chunk = (to_read > BUFFER_SIZE) ? BUFFER_SIZE : to_read;
+        rfile = throttled_read(job_fd, buffer, chunk);
+        if (rfile == -1) {
+            return -1;
+        }
+        if (rfile == 0) {
+            break; // End of file
+        }
+        for (ssize_t k = 0; k < rfile; k++, pos++) {
+            state = ac->delta[state * ac->nclasses + ac->class_of[buffer[k]]];
+            if (pos < length) {
+                ac->hits[state]++;
+            }
+            else {
+                for (int t = ac->out_link[state]; t != -1; t = ac->out_link[ac->fail[t]]) {
+                    if (pos - ac->term_len[t] + 1 < length) {
+                        ac->tail_hits[t]++;
+                    }
+                }
+            }
+        }
+        to_read -= rfile;
+    }
+
+    // Every position that ends in state s also ends in fail[s]: push the hits
+    // down the failure tree, deepest states first
+    for (int k = ac->nstates - 2; k >= 0; k--) {
+        int s = ac->bfs_order[k];
+        ac->hits[ac->fail[s]] += ac->hits[s];
+    }
+    for (int p = 0; p < ac->npatterns; p++) {
+        counts[p] = ac->hits[ac->pattern_state[p]] + ac->tail_hits[ac->pattern_state[p]];
+    }
+    return 0;
+}
+
+// UTF-8 mode ("U+XXXX"): count one code point and all code points, and validate
+// The dispatcher moves chunk boundaries onto lead bytes, so every chunk is
+// checked on its own and an incomplete sequence at its end is an error
+// (the target is parsed by parse_utf8_target in search.h, as in the dispatcher)
+
+#ifdef __SSSE3__
+// Error bits of the lookup validator (Keiser & Lemire, "Validating UTF-8 In
+// Less Than One Instruction Per Byte"): three nibble lookups classify every
+// pair of consecutive bytes, and a valid pair has no bit set in all three
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+typedef struct {
+    __m128i prev; // Previous 16 bytes of the chunk
+    __m128i error; // Accumulated error bits
+    __m128i found; // Per-lane target matches (flushed before they overflow)
+    __m128i codepoints; // Per-lane lead byte counts (flushed before they overflow)
+    int blocks; // Blocks since the last flush
+} Utf8State;
+
+// Sum of the 16 unsigned byte lanes
+long sum_lanes(__m128i v) {
+    __m128i sums = _mm_sad_epu8(v, _mm_setzero_si128());
+    return _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+}
+
+void utf8_block(Utf8State *st, const Utf8Target *t, __m128i input) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i prev1 = _mm_alignr_epi8(input, st->prev, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, st->prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, st->prev, 13);
+
+    __m128i byte_1_high = _mm_shuffle_epi8(_mm_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4),
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(_mm_setr_epi8(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000),
+        _mm_and_si128(prev1, nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(_mm_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT),
+        _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // Third and fourth bytes of a sequence must be continuations, and TWO_CONTS says exactly that
+    __m128i is_third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+    __m128i is_fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8((char)0x80));
+    st->error = _mm_or_si128(st->error, _mm_xor_si128(must23, special));
+
+    // Every byte that is not a continuation (0x80-0xBF) starts a code point
+    st->codepoints = _mm_sub_epi8(st->codepoints, _mm_cmpgt_epi8(input, _mm_set1_epi8((char)0xBF)));
+
+    // The target ends at this byte if the last t->len bytes are its encoding
+    __m128i match = _mm_cmpeq_epi8(input, _mm_set1_epi8(t->bytes[t->len - 1]));
+    if (t->len >= 2) match = _mm_and_si128(match, _mm_cmpeq_epi8(prev1, _mm_set1_epi8(t->bytes[t->len - 2])));
+    if (t->len >= 3) match = _mm_and_si128(match, _mm_cmpeq_epi8(prev2, _mm_set1_epi8(t->bytes[t->len - 3])));
+    if (t->len == 4) match = _mm_and_si128(match, _mm_cmpeq_epi8(prev3, _mm_set1_epi8(t->bytes[0])));
+    st->found = _mm_sub_epi8(st->found, match);
+
+    st->prev = input;
+}
+
+// Scan one chunk: returns 1 if it is valid UTF-8, 0 if not, -1 on read error
+int scan_utf8(int job_fd, off_t to_read, const Utf8Target *t, long *found, long *codepoints) {
+    unsigned char buffer[16 + BUFFER_SIZE];
+    int keep = 0; // Bytes that did not fill a block yet
+    Utf8State st;
+    st.prev = st.error = st.found = st.codepoints = _mm_setzero_si128();
+    st.blocks = 0;
+    *found = 0;
+    *codepoints = 0;
+
+    while (1) {
+        if (cancelled) {
+            return 1; // The result is thrown away
+        }
+        int chunk = (to_read > BUFFER_SIZE) ? BUFFER_SIZE : to_read;
+        ssize_t rfile = (chunk > 0) ? throttled_read(job_fd, buffer + keep, chunk) : 0;
+        if (rfile == -1) {
+            return -1;
+        }
+        int have = keep + rfile;
+        to_read -= rfile;
+
+        int pad = 0;
+        if (rfile == 0) {
+            // Last, partial block: zero padding is ASCII, so a sequence cut by the end is an error
+            pad = (16 - have % 16) % 16;
+            memset(buffer + have, 0, pad);
+            have += pad;
+        }
+
+        int i;
+        for (i = 0; i + 16 <= have; i += 16) {
+            utf8_block(&st, t, _mm_loadu_si128((const __m128i *)(buffer + i)));
+            if (++st.blocks == 255) {
+                *found += sum_lanes(st.found);
+                *codepoints += sum_lanes(st.codepoints);
+                st.found = st.codepoints = _mm_setzero_si128();
+                st.blocks = 0;
+            }
+        }
+        keep = have - i;
+        memmove(buffer, buffer + i, keep);
+
+        if (rfile == 0) {
+            *found += sum_lanes(st.found);
+            *codepoints += sum_lanes(st.codepoints) - pad;
+            if (t->len == 1 && t->bytes[0] == 0) {
+                *found -= pad; // The padding matched U+0000
+            }
+            // A sequence may still be open in the last three bytes of the last block
+            __m128i incomplete = _mm_subs_epu8(st.prev, _mm_setr_epi8(
+                (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255,
+                (char)255, (char)255, (char)255, (char)255, (char)255, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1)));
+            st.error = _mm_or_si128(st.error, incomplete);
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(st.error, _mm_setzero_si128())) == 0xFFFF;
+        }
+    }
+}
+#else
+// Scalar fallback: decode byte by byte, with a 16-byte ASCII fast path on SSE2
+int scan_utf8(int job_fd, off_t to_read, const Utf8Target *t, long *found, long *codepoints) {
+    unsigned char buffer[BUFFER_SIZE];
+    int need = 0; // Continuation bytes still expected
+    unsigned char lo = 0x80, hi = 0xBF; // Allowed range of the next continuation byte
+    long cp = 0;
+    long target = 0;
+    int valid = 1;
+    for (int k = 0; k < t->len; k++) {
+        target = (target << 8) | t->bytes[k]; // Compare the encoded form, no need to decode
+    }
+    *found = 0;
+    *codepoints = 0;
+
+    while (to_read > 0 && !cancelled) {
+        int chunk = (to_read > BUFFER_SIZE) ? BUFFER_SIZE : to_read;
+        ssize_t rfile = throttled_read(job_fd, buffer, chunk);
+        if (rfile == -1) {
+            return -1;
+        }
+        if (rfile == 0) {
+            break;
+        }
+        to_read -= rfile;
+
+        for (ssize_t i = 0; i < rfile; i++) {
+#ifdef __SSE2__
+            if (need == 0 && t->len > 1 && i + 16 <= rfile &&
+                _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(buffer + i))) == 0) {
+                *codepoints += 16;
+                i += 15;
+                continue;
+            }
+#endif
+            unsigned char b = buffer[i];
+            if (need > 0) {
+                if (b < lo || b > hi) {
+                    valid = 0;
+                    need = 0;
+                    i--; // Resynchronise on this byte
+                    continue;
+                }
+                cp = (cp << 8) | b;
+                lo = 0x80;
+                hi = 0xBF;
+                if (--need > 0) {
+                    continue;
+                }
+            }
+            else {
+                (*codepoints)++;
+                cp = b;
+                if (b >= 0x80) {
+                    if (b >= 0xC2 && b <= 0xDF) need = 1;
+                    else if (b == 0xE0) { need = 2; lo = 0xA0; }
+                    else if (b == 0xED) { need = 2; hi = 0x9F; }
+                    else if (b >= 0xE1 && b <= 0xEF) need = 2;
+                    else if (b == 0xF0) { need = 3; lo = 0x90; }
+                    else if (b == 0xF4) { need = 3; hi = 0x8F; }
+                    else if (b >= 0xF1 && b <= 0xF3) need = 3;
+                    else valid = 0;
+                    if (need > 0) {
+                        continue;
+                    }
+                }
+            }
+            if (cp == target) {
+                (*found)++;
+            }
+        }
+    }
+    return valid && need == 0;
+}
+#endif
+
+// Read one result line of a child, -1 if the child is gone
+int read_child_line(int fd, char *line, int cap) {
+    int len = 0;
+    while (len == 0 || line[len - 1] != '\n') {
+        if (len == cap - 1) {
+            return -1;
+        }
+        ssize_t n = read(fd, line + len, cap - 1 - len);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+// Move a split point back onto the lead byte of a UTF-8 sequence, as the dispatcher does
+off_t utf8_align_back(int fd, off_t pos) {
+    unsigned char b[4];
+    if (pos < 4 || pread(fd, b, 4, pos - 3) != 4) {
+        return pos;
+    }
+    int back = 0;
+    while (back < 3 && (b[3 - back] & 0xC0) == 0x80) {
+        back++;
+    }
+    return ((b[3 - back] & 0xC0) == 0x80) ? pos : pos - back;
+}
+
+// Merge the wc fields of the next piece (b) into the pieces before it (a)
+// Fields after the total: words bytes starts_in_word ends_in_word prefix_len suffix_len max_line has_newline
+void wc_merge(long *a, const long *b) {
+    long line_across = (a[8] && b[8]) ? a[6] + b[5] : 0; // Line from a's last newline to b's first one
+    a[0] += b[0];
+    a[1] += b[1] - (a[4] == 1 && b[3]); // A word across the split was counted twice
+    if (a[4] == -1) a[3] = b[3]; // No space or word byte in a yet
+    if (b[4] != -1) a[4] = b[4];
+    a[5] = a[8] ? a[5] : a[2] + b[5];
+    a[6] = b[8] ? b[6] : a[6] + b[2];
+    if (b[7] > a[7]) a[7] = b[7];
+    if (line_across > a[7]) a[7] = line_across;
+    a[8] = a[8] || b[8];
+    a[2] += b[2];
+}
+
+// Sub-dispatcher mode ("--group F L" after the usual arguments): instead of
+// counting, the process forks F initialized copies of itself and answers each
+// "offset length" command by splitting the range among them and merging their
+// result lines into one, in the same format. With L > 1 the copies are
+// sub-dispatchers themselves, so one process at the top drives F^L workers and
+// every level only sees F result lines per range.
+// If a child dies the sub-dispatcher exits, and the dispatcher requeues its range.
+// Returns only in a new leaf worker, with its pipes on stdin/stdout
+void run_group(const char *input_file, int fanout, int levels, int wc_mode, int utf8_mode) {
+    int child_in[MAX_GROUP_FANOUT]; // Commands to the child
+    int child_out[MAX_GROUP_FANOUT]; // Its result lines
+
+    for (int k = 0; k < fanout; k++) {
+        int to_child[2], from_child[2];
+        if (pipe(to_child) == -1 || pipe(from_child) == -1) {
+            perror("[GROUP] pipe failed");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("[GROUP] fork failed");
+            exit(1);
+        }
+        if (pid == 0) {
+            group_size = 0; // The siblings are not ours
+            dup2(to_child[0], STDIN_FILENO);
+            dup2(from_child[1], STDOUT_FILENO);
+            close(to_child[0]);
+            close(to_child[1]);
+            close(from_child[0]);
+            close(from_child[1]);
+            for (int m = 0; m < k; m++) {
+                close(child_in[m]);
+                close(child_out[m]);
+            }
+            if (levels > 1) {
+                run_group(input_file, fanout, levels - 1, wc_mode, utf8_mode);
+            }
+            return;
+        }
+        close(to_child[0]);
+        close(from_child[1]);
+        child_in[k] = to_child[1];
+        child_out[k] = from_child[0];
+        group_pids[k] = pid;
+        group_size = k + 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // A dead child shows up as EOF on its pipe
+
+    int fd = open(input_file, O_RDONLY); // Only for the UTF-8 split points
+    char msg[128];
+    snprintf(msg, sizeof(msg), "[GROUP %d] Sub-dispatcher for %d workers, %d level(s)\n", getpid(), fanout, levels);
+    write(STDERR_FILENO, msg, strlen(msg));
+
+    static char line[24 * RESULT_FIELDS];
+    long total[RESULT_FIELDS], piece_fields[RESULT_FIELDS];
+    while (1) {
+        char command[128];
+        ssize_t bytes_read = read(STDIN_FILENO, command, sizeof(command) - 1);
+        if (bytes_read <= 0) {
+            exit(0); // The children see EOF too and exit
+        }
+        command[bytes_read] = '\0';
+        long offset, length;
+        int extra = 0; // Passed on to every child (rank counts; offsets never come here)
+        if (sscanf(command, "%ld %ld %d", &offset, &length, &extra) < 2 || length <= 0) {
+            write(STDERR_FILENO, "[GROUP] Invalid work command format\n", 36);
+            continue;
+        }
+        cancelled = 0;
+
+        // One piece per child, none smaller than GROUP_MIN_PIECE
+        int pieces = fanout;
+        while (pieces > 1 && length / pieces < GROUP_MIN_PIECE) {
+            pieces--;
+        }
+        off_t pos = offset;
+        for (int k = 0; k < pieces; k++) {
+            off_t end = offset + length * (k + 1) / pieces;
+            if (utf8_mode && k < pieces - 1 && fd != -1) {
+                end = utf8_align_back(fd, end);
+            }
+            int len = (extra != 0) ? snprintf(msg, sizeof(msg), "%ld %ld %d\n", (long)pos, (long)(end - pos), extra)
+                                   : snprintf(msg, sizeof(msg), "%ld %ld\n", (long)pos, (long)(end - pos));
+            write(child_in[k], msg, len);
+            pos = end;
+        }
+
+        // The answers, in file order
+        int nfields = 0, any_cancelled = 0;
+        for (int k = 0; k < pieces; k++) {
+            if (read_child_line(child_out[k], line, sizeof(line)) == -1) {
+                write(STDERR_FILENO, "[GROUP] A worker died, giving up the range\n", 43);
+                exit(1);
+            }
+            if (strncmp(line, "cancelled", 9) == 0) {
+                any_cancelled = 1;
+                continue;
+            }
+            char *next = line;
+            int n = 0;
+            while (n < RESULT_FIELDS) {
+                char *end;
+                long value = strtol(next, &end, 10);
+                if (end == next) {
+                    break;
+                }
+                piece_fields[n++] = value;
+                next = end;
+            }
+            if (nfields == 0) {
+                memcpy(total, piece_fields, sizeof(long) * n);
+                nfields = n;
+            }
+            else if (wc_mode) {
+                wc_merge(total, piece_fields);
+            }
+            else {
+                for (int f = 0; f < n && f < nfields; f++) {
+                    total[f] += piece_fields[f]; // Counts add up, an invalid UTF-8 flag stays non-zero
+                }
+            }
+        }
+
+        if (any_cancelled || cancelled) {
+            write(STDOUT_FILENO, "cancelled\n", 10);
+            continue;
+        }
+        int len = 0;
+        for (int f = 0; f < nfields; f++) {
+            len += snprintf(line + len, sizeof(line) - len, (f == 0) ? "%ld" : " %ld", total[f]);
+        }
+        len += snprintf(line + len, sizeof(line) - len, "\n");
+        write(STDOUT_FILENO, line, len);
+    }
+}
+
+// Zygote mode ("--zygote" after the usual arguments): the worker initializes
+// once (search string or automaton, file size) and then waits on stdin, a unix
+// socket from the dispatcher. Every request carries the two pipe ends of a new
+// worker (SCM_RIGHTS); the zygote forks an already initialized copy of itself
+// on them, so there is no exec, no dynamic linking and no setup per worker.
+// The copy is forked through a short-lived middle process, so it is orphaned
+// and re-parented to the dispatcher (a child subreaper) which can wait for it.
+// Returns only in a new worker, with its pipes on stdin/stdout
+void run_zygote() {
+    while (1) {
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        union {
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        if (recvmsg(STDIN_FILENO, &msg, 0) <= 0) {
+            exit(0); // Dispatcher is gone
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+            write(STDERR_FILENO, "[ZYGOTE] Bad spawn request\n", 27);
+            continue;
+        }
+        int fds[2]; // Worker's stdin (commands) and stdout (results)
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+        // The middle process passes the worker pid back through pid_pipe; the
+        // zygote answers only after the middle process is gone, so the worker is
+        // already the dispatcher's child when the dispatcher gets the pid
+        pid_t worker = -1;
+        int pid_pipe[2];
+        if (pipe(pid_pipe) == 0) {
+            pid_t middle = fork();
+            if (middle == 0) {
+                close(pid_pipe[0]);
+                worker = fork();
+                if (worker == 0) {
+                    close(pid_pipe[1]);
+                    dup2(fds[0], STDIN_FILENO); // The zygote socket is replaced here
+                    dup2(fds[1], STDOUT_FILENO);
+                    close(fds[0]);
+                    close(fds[1]);
+                    return;
+                }
+                write(pid_pipe[1], &worker, sizeof(worker));
+                _exit(0);
+            }
+            close(pid_pipe[1]);
+            if (middle != -1) {
+                waitpid(middle, NULL, 0);
+                if (read(pid_pipe[0], &worker, sizeof(worker)) != sizeof(worker)) {
+                    worker = -1;
+                }
+            }
+            close(pid_pipe[0]);
+        }
+        write(STDIN_FILENO, &worker, sizeof(worker)); // -1 if a fork failed
+        close(fds[0]);
+        close(fds[1]);
     }
-    return count;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
+    int zygote = (argc == 4 && strcmp(argv[3], "--zygote") == 0);
+    int group = (argc == 6 && strcmp(argv[3], "--group") == 0);
+    if (argc != 3 && !zygote && !group) {
         perror("[WORKER] Wrong number of arguments");
         return 1;
     }
-    if (argv[2][1] != '\0') {
-        perror("[WORKER] I need a single character input");
-        return 2;
-    }
-
     const char *input_file = argv[1];
-    char search_char = argv[2][0];
+
+    // Cancellation: SA_RESTART so reads are not cut short, only the sleep is
+    // Installed before the zygote starts, so every forked worker has it
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_cancel;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    char needle[MAX_NEEDLE];
+    int needle_len;
+    // "@file" counts every pattern listed in the file in a single pass
+    static Automaton ac;
+    int pattern_mode = (argv[2][0] == '@');
+    static long pattern_counts[MAX_PATTERNS];
+    // "--wc" computes line, word and byte statistics like wc
+    int wc_mode = (strcmp(argv[2], "--wc") == 0);
+    WcStats wc;
+    // "U+XXXX" counts one Unicode code point and validates UTF-8
+    Utf8Target utf8_target;
+    int utf8_mode = is_utf8_arg(argv[2]);
+    long codepoints = 0;
+    int utf8_valid = 1;
+    // "[...]" counts the bytes of a byte class, like one character
+    ByteClass byte_class;
+    int class_mode = (parse_byte_class(argv[2], &byte_class) == 0); // "[" or "[i" stay ordinary strings
+    if (wc_mode) {
+        needle_len = 1; // Words and lines are stitched by the dispatcher, no overlap needed
+    }
+    else if (utf8_mode) {
+        if (parse_utf8_target(argv[2], &utf8_target) == -1) {
+            fprintf(stderr, "[WORKER] Invalid code point %s\n", argv[2]);
+            return 2;
+        }
+        needle_len = 1; // Chunks are aligned to code points, no overlap needed
+    }
+    else if (class_mode) {
+        needle_len = 1; // One byte at a time, no overlap needed
+    }
+    else if (pattern_mode) {
+        const char *error;
+        if (build_automaton(argv[2] + 1, &ac, &error) == -1) {
+            fprintf(stderr, "[WORKER] Pattern file %s: %s\n", argv[2] + 1, error);
+            return 2;
+        }
+        needle_len = ac.max_len;
+    }
+    else {
+        needle_len = unescape_needle(argv[2], needle);
+        if (needle_len == -1) {
+            fprintf(stderr, "[WORKER] I need a search string of 1 to 256 bytes, \\xHH with two hex digits\n");
+            return 2;
+        }
+    }
 
     // Open the file once
     int fd = open(input_file, O_RDONLY);
@@ -49,6 +1041,31 @@ int main(int argc, char *argv[]) {
 
     off_t filesize = st.st_size; // Total file size (can be useful later)
 
+    // A ".gz" input is read through the dispatcher's index, in uncompressed offsets
+    size_t name_len = strlen(input_file);
+    if (name_len > 3 && strcmp(input_file + name_len - 3, ".gz") == 0) {
+        if (load_gz_index(input_file, &st) == -1) {
+            fprintf(stderr, "[WORKER] No valid index for the gzip input\n");
+            return 1;
+        }
+        filesize = gz_index->uncompressed_size;
+    }
+
+    map_throttle(); // Before the forks, the zygote's workers and the group's leaves share it
+
+    if (zygote) {
+        run_zygote(); // Returns in every new worker
+    }
+    if (group) {
+        int fanout = atoi(argv[4]);
+        int levels = atoi(argv[5]);
+        if (fanout < 1 || fanout > MAX_GROUP_FANOUT || levels < 1) {
+            fprintf(stderr, "[WORKER] Bad sub-dispatcher fan-out or levels: %s %s (fan-out 1 to %d, levels 1 or more)\n", argv[4], argv[5], MAX_GROUP_FANOUT);
+            return 2;
+        }
+        run_group(input_file, fanout, levels, wc_mode, utf8_mode); // Returns in every leaf worker
+    }
+
     char msg[256];
     snprintf(msg, sizeof(msg), "[WORKER %d] Ready to work (file size: %ld bytes)\n", getpid(), (long)filesize);
     write(STDERR_FILENO, msg, strlen(msg));
@@ -70,61 +1087,188 @@ int main(int argc, char *argv[]) {
 
                 long offset;
                 int length;
-                if (sscanf(buffer_cmd, "%ld %d", &offset, &length) != 2) {
+                int extra = 0; // "offset length 1": also send the offset of every match,
+                               // "offset length 2": the count of every byte of the class (rank)
+                if (sscanf(buffer_cmd, "%ld %d %d", &offset, &length, &extra) < 2) {
                     write(STDERR_FILENO, "[WORKER] Invalid work command format\n", 38);
                     continue;
                 }
+                int want_offsets = (extra == 1);
+                int want_ranks = (extra == 2 && class_mode);
+                static long byte_counts[256];
+                memset(byte_counts, 0, sizeof(byte_counts));
+                cancelled = 0; // A cancel that came before this command was for older work
+                apply_priority();
 
                 // Open the input file for the job
-                int job_fd = open(input_file, O_RDONLY);
+                // (for a gzip input, its decompressed range, already at the offset)
+                int job_fd;
+                if (gz_index != NULL) {
+                    long range = length + needle_len - 1;
+                    job_fd = gz_open_range(input_file, offset, (offset + range > filesize) ? filesize - offset : range);
+                }
+                else {
+                    job_fd = open(input_file, O_RDONLY);
+                }
+                // Without an answer the chunk would stay in flight on this worker for
+                // good: exit instead, the dispatcher puts the chunk back in the pool
+                if (job_fd == -1 && gz_index != NULL) {
+                    fprintf(stderr, "[WORKER] Failed to inflate the chunk at %ld of the gzip input\n", offset);
+                    return 1;
+                }
                 if (job_fd == -1) {
                     write(STDERR_FILENO, "[WORKER] Failed to open input file for job\n", 44);
-                    continue;
+                    return 1;
                 }
 
                 // Move the file pointer to the correct offset
-                if (lseek(job_fd, offset, SEEK_SET) == (off_t)-1) {
+                if (gz_index == NULL && lseek(job_fd, offset, SEEK_SET) == (off_t)-1) {
                     write(STDERR_FILENO, "[WORKER] lseek failed\n", 23);
                     close(job_fd);
-                    continue;
+                    return 1;
                 }
 
 
+                // Read needle_len - 1 bytes past the chunk, so a match that starts
+                // in this chunk and ends in the next one is counted here (and only here)
                 int total_count = 0;
-                int to_read = length;
-                char buffer[BUFFER_SIZE];
+                off_t to_read = length + needle_len - 1;
+                if (offset + to_read > filesize) {
+                    to_read = filesize - offset;
+                }
+                char buffer[MAX_NEEDLE + BUFFER_SIZE];
+                int keep = 0; // Tail of the previous read, a match may start there
                 ssize_t rfile;
+                static OffsetList offsets;
+                offsets.len = 0;
+                long buffer_offset = offset; // File offset of buffer[0]
+                long last_match = offset;
 
-                do {
+                if (pattern_mode) {
+                    if (scan_patterns(&ac, job_fd, length, to_read, pattern_counts) == -1) {
+                        perror("[WORKER] Problem reading characters\n");
+                        close(job_fd);
+                        return 1;
+                    }
+                    for (int p = 0; p < ac.npatterns; p++) {
+                        if (ac.duplicate_of[p] == -1) {
+                            total_count += pattern_counts[p];
+                        }
+                    }
+                    to_read = 0;
+                }
+                else if (wc_mode) {
+                    wc_init(&wc);
+                    while (to_read > 0 && !cancelled) {
+                        int chunk = (to_read > BUFFER_SIZE) ? BUFFER_SIZE : to_read;
+                        rfile = throttled_read(job_fd, buffer, chunk);
+                        if (rfile == -1) {
+                            perror("[WORKER] Problem reading characters\n");
+                            close(job_fd);
+                            return 1;
+                        }
+                        if (rfile == 0) {
+                            break; // End of file
+                        }
+                        wc_update(&wc, (unsigned char *)buffer, rfile);
+                        to_read -= rfile;
+                    }
+                    total_count = wc.lines;
+                }
+                else if (utf8_mode) {
+                    long found;
+                    utf8_valid = scan_utf8(job_fd, to_read, &utf8_target, &found, &codepoints);
+                    if (utf8_valid == -1) {
+                        perror("[WORKER] Problem reading characters\n");
+                        close(job_fd);
+                        return 1;
+                    }
+                    total_count = found;
+                    to_read = 0;
+                }
+
+                while (to_read > 0 && !cancelled) {
                     int chunk = (to_read > BUFFER_SIZE) ? BUFFER_SIZE : to_read;
-                    rfile = read(job_fd, buffer, chunk);
+                    rfile = throttled_read(job_fd, buffer + keep, chunk);
                     if (rfile == -1) {
                         perror("[WORKER] Problem reading characters\n");
                         close(job_fd);
                         return 1;
                     }
                     
-                    buffer[rfile] = '\0'; // Null-terminate the buffer
-                    total_count += buf_counter(buffer, rfile, search_char);
+                    int have = keep + rfile;
+                    if (want_ranks) {
+                        total_count += class_histogram(buffer, have, &byte_class, byte_counts);
+                    }
+                    else {
+                        total_count += class_mode ? class_counter(buffer, have, &byte_class)
+                                                  : substr_counter(buffer, have, needle, needle_len);
+                    }
+                    if (want_offsets) {
+                        substr_offsets(buffer, have, needle, needle_len, buffer_offset, &last_match, &offsets);
+                    }
                     to_read -= rfile;
+
+                    // Matches starting in the last needle_len - 1 bytes did not fit, keep them for the next read
+                    keep = (have < needle_len - 1) ? have : needle_len - 1;
+                    memmove(buffer, buffer + have - keep, keep);
+                    buffer_offset += have - keep;
                     
                     if (rfile == 0) {
                         break; // End of file
                     }
                 }
-                while (to_read > 0 && rfile != 0);
 
                 close(job_fd);
                 
                 // Simulate some processing time
+                // Built with -DNO_DEMO_SLEEP for benchmarks (loadgen), the chunk is answered at once
+#ifndef NO_DEMO_SLEEP
                 srand(time(NULL) ^ getpid()); // Seed randomness per worker
                 sleep(rand() % 3 + 10); // Random sleep between 10 and 12 seconds
+#endif
+
+                // Cancelled: the chunk is abandoned, the worker waits for the next one
+                if (cancelled) {
+                    write(STDOUT_FILENO, "cancelled\n", 10);
+                    continue;
+                }
                 
                 // Send the result back to the dispatcher
-                char result[64];
-                int len = snprintf(result, sizeof(result), "%d\n", total_count);
+                // In pattern mode the total is followed by the count of every pattern,
+                // in rank mode by the count of every byte of the class, in byte order
+                static char result[24 * (MAX_PATTERNS + 1)];
+                int len = snprintf(result, sizeof(result), "%d", total_count);
+                for (int p = 0; pattern_mode && p < ac.npatterns; p++) {
+                    len += snprintf(result + len, sizeof(result) - len, " %ld", pattern_counts[p]);
+                }
+                if (utf8_mode) {
+                    len += snprintf(result + len, sizeof(result) - len, " %ld %d", codepoints, !utf8_valid);
+                }
+                if (wc_mode) {
+                    len += snprintf(result + len, sizeof(result) - len, " %ld %ld %d %d %ld %ld %ld %d",
+                                    wc.words, wc.bytes, wc.starts_in_word, wc.ends_in_word,
+                                    wc.prefix_len, wc.suffix_len, wc.max_line, wc.has_newline);
+                }
+                for (int b = 0; want_ranks && b < 256; b++) {
+                    if (byte_class.member[b]) {
+                        len += snprintf(result + len, sizeof(result) - len, " %ld", byte_counts[b]);
+                    }
+                }
+                len += snprintf(result + len, sizeof(result) - len, "\n");
                 // Error handling
-                if (len > 0 && len < (int)sizeof(result)) {
+                if (want_offsets && len > 0 && len < (int)sizeof(result)) {
+                    // The offset list goes between the counts and the newline
+                    struct iovec iov[3] = {
+                        { result, len - 1 },
+                        { offsets.text, offsets.len },
+                        { "\n", 1 },
+                    };
+                    if (writev(STDOUT_FILENO, iov, 3) != len + offsets.len) {
+                        write(STDERR_FILENO, "[WORKER] Failed to write full result\n", 36);
+                    }
+                }
+                else if (len > 0 && len < (int)sizeof(result)) {
                     ssize_t written = write(STDOUT_FILENO, result, len);
                     if (written != len) {
                         write(STDERR_FILENO, "[WORKER] Failed to write full result\n", 36);
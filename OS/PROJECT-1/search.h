@@ -0,0 +1,478 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+// Search-string helpers shared by the counters of 1.3 and 1.4
+// (1.3.c, worker.c, dispatcher.c, loadgen.c, rangecount.c include it as "../search.h")
+// Header only, every program is still built from its one .c file
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+#define MAX_NEEDLE 256 // Longest search string, also the longest overlap a worker reads
+#define SIMD_NEEDLE_MAX 32 // Longer needles use Boyer-Moore-Horspool
+#define MAX_PATTERNS 512 // Patterns in a "@file" pattern set
+
+// Decode one byte of a search argument and move past it
+// C-style escapes: \n, \r, \t, \xHH (exactly two hex digits), any other \c is c
+// Returns -1 for a "\x" that is not followed by two hex digits
+static inline int decode_escape(const char **src) {
+    const char *s = *src;
+    int b;
+    if (s[0] == '\\' && s[1] != '\0') {
+        s++;
+        if (*s == 'n') b = '\n';
+        else if (*s == 'r') b = '\r';
+        else if (*s == 't') b = '\t';
+        else if (*s == 'x') {
+            if (!isxdigit((unsigned char)s[1]) || !isxdigit((unsigned char)s[2])) {
+                return -1;
+            }
+            char hex[3] = { s[1], s[2], '\0' };
+            b = (int)strtol(hex, NULL, 16);
+            s += 2;
+        }
+        else b = (unsigned char)*s;
+        s++;
+    }
+    else {
+        b = (unsigned char)*s++;
+    }
+    *src = s;
+    return b;
+}
+
+// Decode the escapes of a search string, so tokens like "\r\n" can be given on the command line
+// Returns the decoded length, or -1 if it is empty, too long or has a bad escape
+static inline int unescape_needle(const char *src, char *dst) {
+    int n = 0;
+    while (*src != '\0') {
+        if (n >= MAX_NEEDLE) {
+            return -1;
+        }
+        int b = decode_escape(&src);
+        if (b == -1) {
+            return -1;
+        }
+        dst[n++] = (char)b;
+    }
+    return (n > 0) ? n : -1;
+}
+
+// Count the number of times a character appears in a buffer
+// SSE2 compares 16 bytes at a time
+static inline int buf_counter(const char *buffer, ssize_t len, char c2c) {
+    int count = 0;
+    ssize_t i = 0;
+#ifdef __SSE2__
+    const __m128i target = _mm_set1_epi8(c2c);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buffer + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, target)));
+    }
+#endif
+    for (; i < len; i++) {
+        if (buffer[i] == c2c) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Boyer-Moore-Horspool for long needles: the skip table lets us jump up to
+// n bytes on a mismatch instead of testing every position
+static inline int bmh_counter(const char *buffer, ssize_t len, const char *needle, int n) {
+    int skip[256];
+    int count = 0;
+    for (int i = 0; i < 256; i++) {
+        skip[i] = n;
+    }
+    for (int i = 0; i < n - 1; i++) {
+        skip[(unsigned char)needle[i]] = n - 1 - i;
+    }
+    for (ssize_t i = 0; i + n <= len; i += skip[(unsigned char)buffer[i + n - 1]]) {
+        if (buffer[i + n - 1] == needle[n - 1] && memcmp(buffer + i, needle, n - 1) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Count the (possibly overlapping) occurrences of needle that lie fully inside the buffer
+// SSE2 compares the first and the last byte of the needle at 16 positions at once
+// and only the candidates where both match are verified with memcmp
+static inline int substr_counter(const char *buffer, ssize_t len, const char *needle, int n) {
+    if (n == 1) {
+        return buf_counter(buffer, len, needle[0]);
+    }
+    if (n > SIMD_NEEDLE_MAX) {
+        return bmh_counter(buffer, len, needle, n);
+    }
+
+    int count = 0;
+    ssize_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(buffer + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(buffer + i + bit + 1, needle + 1, n - 2) == 0) {
+                count++;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + n <= len; i++) {
+        if (buffer[i] == needle[0] && buffer[i + n - 1] == needle[n - 1] && memcmp(buffer + i, needle, n) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Byte class ("[0-9a-f]", "[,;\t]", "[^\x00-\x7f]"): single bytes and ranges,
+// '^' first negates it, escapes as in the search string plus \] and \-
+// The rows are the nibble lookup tables of the SIMD counter: entry L has bit h
+// set if byte (h << 4 | L) is in the class, h = 0-7 in low_rows, 8-15 in high_rows
+typedef struct {
+    unsigned char member[256]; // 1 = in the class
+    unsigned char low_rows[16];
+    unsigned char high_rows[16];
+} ByteClass;
+
+// Compile "[...]" into the membership table and the nibble rows
+// Returns -1 if it is not a class (no brackets, empty, a range backwards, a bad escape):
+// the argument is then an ordinary search string, "[" or "[i" included
+static inline int parse_byte_class(const char *arg, ByteClass *bc) {
+    size_t n = strlen(arg);
+    if (n < 3 || arg[0] != '[' || arg[n - 1] != ']') {
+        return -1;
+    }
+    const char *s = arg + 1;
+    const char *end = arg + n - 1; // The closing bracket
+    int negate = (s[0] == '^' && s + 1 < end);
+    if (negate) {
+        s++;
+    }
+    memset(bc, 0, sizeof(*bc));
+    while (s < end) {
+        int lo = decode_escape(&s);
+        int hi = lo;
+        if (lo != -1 && s[0] == '-' && s + 1 < end) {
+            s++;
+            hi = decode_escape(&s);
+        }
+        if (lo == -1 || hi == -1 || s > end || hi < lo) {
+            return -1; // A bad escape, an escape that took the closing bracket, or "z-a"
+        }
+        memset(bc->member + lo, 1, hi - lo + 1);
+    }
+    for (int b = 0; b < 256; b++) {
+        bc->member[b] ^= negate;
+        if (bc->member[b] && b < 128) bc->low_rows[b & 15] |= 1 << (b >> 4);
+        else if (bc->member[b]) bc->high_rows[b & 15] |= 1 << ((b >> 4) - 8);
+    }
+    return 0;
+}
+
+// Count the bytes of the buffer that are in the class, in one pass
+// PSHUFB looks up 16 rows at once: the low nibble (with the top bit of the
+// byte) picks the row, an index with the top bit set gives 0, so for every byte
+// only one of low_rows and high_rows answers; the high nibble picks the bit.
+// AVX-512BW does 64 bytes per step, AVX2 32 and SSSE3 16 (gcc -O2 -march=native)
+static inline int class_counter(const char *buffer, ssize_t len, const ByteClass *bc) {
+    int count = 0;
+    ssize_t i = 0;
+#if defined(__AVX512BW__)
+    const __m512i low = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)bc->low_rows));
+    const __m512i high = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)bc->high_rows));
+    const __m512i bits = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                                              1, 2, 4, 8, 16, 32, 64, (char)128));
+    for (; i + 64 <= len; i += 64) {
+        __m512i block = _mm512_loadu_si512((const void *)(buffer + i));
+        __m512i index = _mm512_and_si512(block, _mm512_set1_epi8((char)0x8F));
+        __m512i rows = _mm512_or_si512(_mm512_shuffle_epi8(low, index),
+                                       _mm512_shuffle_epi8(high, _mm512_xor_si512(index, _mm512_set1_epi8((char)0x80))));
+        __m512i bit = _mm512_shuffle_epi8(bits, _mm512_and_si512(_mm512_srli_epi16(block, 4), _mm512_set1_epi8(0x0F)));
+        count += __builtin_popcountll(_mm512_test_epi8_mask(rows, bit));
+    }
+#elif defined(__AVX2__)
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)bc->low_rows));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)bc->high_rows));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128,
+                                          1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i index = _mm256_and_si256(block, _mm256_set1_epi8((char)0x8F));
+        __m256i rows = _mm256_or_si256(_mm256_shuffle_epi8(low, index),
+                                       _mm256_shuffle_epi8(high, _mm256_xor_si256(index, _mm256_set1_epi8((char)0x80))));
+        __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(block, 4), _mm256_set1_epi8(0x0F)));
+        __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(rows, bit), _mm256_setzero_si256());
+        count += 32 - __builtin_popcount((unsigned)_mm256_movemask_epi8(miss));
+    }
+#elif defined(__SSSE3__)
+    const __m128i low = _mm_loadu_si128((const __m128i *)bc->low_rows);
+    const __m128i high = _mm_loadu_si128((const __m128i *)bc->high_rows);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i index = _mm_and_si128(block, _mm_set1_epi8((char)0x8F));
+        __m128i rows = _mm_or_si128(_mm_shuffle_epi8(low, index),
+                                    _mm_shuffle_epi8(high, _mm_xor_si128(index, _mm_set1_epi8((char)0x80))));
+        __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(block, 4), _mm_set1_epi8(0x0F)));
+        __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(rows, bit), _mm_setzero_si128());
+        count += 16 - __builtin_popcount(_mm_movemask_epi8(miss));
+    }
+#endif
+    for (; i < len; i++) {
+        count += bc->member[(unsigned char)buffer[i]];
+    }
+    return count;
+}
+
+// "U+XXXX": one Unicode code point, counted in UTF-8 text
+// The worker and the dispatcher take the same arguments as code points:
+// "U+" followed by at least one more character; "U+" alone is a search string
+static inline int is_utf8_arg(const char *arg) {
+    return arg[0] == 'U' && arg[1] == '+' && arg[2] != '\0';
+}
+
+typedef struct {
+    long codepoint;
+    unsigned char bytes[4]; // Target code point encoded in UTF-8
+    int len;
+} Utf8Target;
+
+// Parse "U+XXXX" and encode the code point
+// Returns -1 if it is not a valid scalar value
+static inline int parse_utf8_target(const char *arg, Utf8Target *t) {
+    char *end;
+    long cp = strtol(arg + 2, &end, 16);
+    if (arg[2] == '\0' || *end != '\0' || cp < 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return -1;
+    }
+    t->codepoint = cp;
+    if (cp < 0x80) {
+        t->bytes[0] = cp;
+        t->len = 1;
+    }
+    else if (cp < 0x800) {
+        t->bytes[0] = 0xC0 | (cp >> 6);
+        t->bytes[1] = 0x80 | (cp & 0x3F);
+        t->len = 2;
+    }
+    else if (cp < 0x10000) {
+        t->bytes[0] = 0xE0 | (cp >> 12);
+        t->bytes[1] = 0x80 | ((cp >> 6) & 0x3F);
+        t->bytes[2] = 0x80 | (cp & 0x3F);
+        t->len = 3;
+    }
+    else {
+        t->bytes[0] = 0xF0 | (cp >> 18);
+        t->bytes[1] = 0x80 | ((cp >> 12) & 0x3F);
+        t->bytes[2] = 0x80 | ((cp >> 6) & 0x3F);
+        t->bytes[3] = 0x80 | (cp & 0x3F);
+        t->len = 4;
+    }
+    return 0;
+}
+
+// wc mode ("--wc"): lines, words, bytes and longest line of a slice of the file
+// A word or a line may continue in the next slice, so the slice also reports
+// how it starts and ends and the caller stitches neighbouring slices together.
+// Words are counted as GNU wc counts them in the C locale (LC_ALL=C wc -w): a
+// word starts at a printable non-space byte ('!'..'~') after a space or at the
+// start, a space (isspace) ends it, and any other byte (control bytes, '\0',
+// bytes >= 0x80) neither starts nor ends one
+typedef struct {
+    long lines; // Newline characters
+    long words; // Word starts, a word at the very beginning of the slice included
+    long bytes;
+    int starts_in_word; // The first space or printable byte is printable: may continue a word
+    int ends_in_word; // 1 = inside a word at the end, 0 = after a space, -1 = neither seen (the slice passes the state on)
+    long prefix_len; // Bytes before the first newline (the whole slice if there is none)
+    long suffix_len; // Bytes after the last newline
+    long max_line; // Longest line that starts and ends inside the slice, in bytes
+    int has_newline;
+} WcStats;
+
+static inline void wc_init(WcStats *st) {
+    memset(st, 0, sizeof(*st));
+    st->ends_in_word = -1;
+}
+
+// Same spaces as isspace() in the C locale: ' ' and \t \n \v \f \r
+static inline int is_space_byte(unsigned char b) {
+    return b == ' ' || (b >= '\t' && b <= '\r');
+}
+
+// Printable and not a space, as isgraph() in the C locale
+static inline int is_word_byte(unsigned char b) {
+    return b > ' ' && b < 0x7F;
+}
+
+// The open line (suffix_len bytes so far) ends at a newline
+static inline void wc_newline(WcStats *st) {
+    st->lines++;
+    if (!st->has_newline) {
+        st->prefix_len = st->suffix_len;
+        st->has_newline = 1;
+    }
+    else if (st->suffix_len > st->max_line) {
+        st->max_line = st->suffix_len;
+    }
+    st->suffix_len = 0;
+}
+
+// Add the next len bytes of the slice to the statistics (wc_init first)
+// SSE2 classifies 16 bytes at a time into newline, space and word bit masks;
+// word starts are word bytes whose previous byte is a space. A block with other
+// bytes is left to the byte loop, they carry the state over themselves
+static inline void wc_update(WcStats *st, const unsigned char *buf, ssize_t len) {
+    ssize_t i = 0;
+    while (i < len) {
+#ifdef __SSE2__
+        for (; i + 16 <= len; i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+            __m128i shifted = _mm_sub_epi8(block, _mm_set1_epi8('\t')); // \t..\r -> 0..4
+            __m128i space = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),
+                                         _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted));
+            __m128i graph = _mm_sub_epi8(block, _mm_set1_epi8('!')); // '!'..'~' -> 0..93
+            graph = _mm_cmpeq_epi8(_mm_min_epu8(graph, _mm_set1_epi8(93)), graph);
+            unsigned word = _mm_movemask_epi8(graph);
+            if ((word | _mm_movemask_epi8(space)) != 0xFFFF) {
+                break; // Other bytes in the block
+            }
+            unsigned newline = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+
+            if (st->ends_in_word == -1) {
+                st->starts_in_word = word & 1;
+            }
+            st->words += __builtin_popcount(word & ~((word << 1) | (st->ends_in_word == 1)));
+            st->ends_in_word = word >> 15;
+
+            int start = 0;
+            while (newline != 0) {
+                int bit = __builtin_ctz(newline);
+                st->suffix_len += bit - start;
+                wc_newline(st);
+                start = bit + 1;
+                newline &= newline - 1;
+            }
+            st->suffix_len += 16 - start;
+            st->bytes += 16;
+        }
+        // The rest of the buffer, or one block with other bytes in it
+        ssize_t end = (i + 16 <= len) ? i + 16 : len;
+#else
+        ssize_t end = len;
+#endif
+        for (; i < end; i++) {
+            unsigned char b = buf[i];
+            if (is_word_byte(b)) {
+                if (st->ends_in_word == -1) {
+                    st->starts_in_word = 1;
+                }
+                if (st->ends_in_word != 1) {
+                    st->words++;
+                }
+                st->ends_in_word = 1;
+            }
+            else if (is_space_byte(b)) {
+                st->ends_in_word = 0;
+            }
+            if (b == '\n') {
+                wc_newline(st);
+            }
+            else {
+                st->suffix_len++;
+            }
+            st->bytes++;
+        }
+    }
+    if (!st->has_newline) {
+        st->prefix_len = st->suffix_len;
+    }
+}
+
+// Pattern set of the "@file" mode: one search string per non-empty line
+// The worker and the dispatcher both read the file with read_pattern_set, so
+// a file one of them rejects is rejected by the other too. A pattern listed
+// twice keeps its line in the report, but only its first line counts in the total
+typedef struct {
+    int count;
+    char text[MAX_PATTERNS][MAX_NEEDLE]; // Decoded
+    int len[MAX_PATTERNS];
+    int duplicate_of[MAX_PATTERNS]; // Earlier line with the same pattern, -1 = first one
+    char name[MAX_PATTERNS][256]; // The line as written, for the report
+    char error[128]; // Why the file was rejected
+} PatternSet;
+
+// Returns -1 if the file cannot be read, has more than MAX_PATTERNS patterns,
+// a line that is not a valid search string, or no pattern at all
+static inline int read_pattern_set(const char *path, PatternSet *set) {
+    char line[4 * MAX_NEEDLE];
+    int line_no = 0;
+    FILE *fp = fopen(path, "r");
+    set->count = 0;
+    if (fp == NULL) {
+        snprintf(set->error, sizeof(set->error), "cannot open it");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        size_t n = strcspn(line, "\n");
+        if (line[n] != '\n' && !feof(fp)) {
+            snprintf(set->error, sizeof(set->error), "line %d is too long", line_no);
+            break;
+        }
+        line[n] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (set->count == MAX_PATTERNS) {
+            snprintf(set->error, sizeof(set->error), "more than %d patterns", MAX_PATTERNS);
+            break;
+        }
+        int p = set->count;
+        set->len[p] = unescape_needle(line, set->text[p]);
+        if (set->len[p] == -1) {
+            snprintf(set->error, sizeof(set->error), "line %d is not a search string of 1 to %d bytes", line_no, MAX_NEEDLE);
+            break;
+        }
+        snprintf(set->name[p], sizeof(set->name[p]), "%.255s", line);
+        set->duplicate_of[p] = -1;
+        for (int q = 0; q < p && set->duplicate_of[p] == -1; q++) {
+            if (set->len[q] == set->len[p] && memcmp(set->text[q], set->text[p], set->len[p]) == 0) {
+                set->duplicate_of[p] = q;
+            }
+        }
+        set->count++;
+    }
+    int failed = !feof(fp);
+    fclose(fp);
+    if (!failed && set->count == 0) {
+        snprintf(set->error, sizeof(set->error), "no patterns");
+        failed = 1;
+    }
+    return failed ? -1 : set->count;
+}
+
+#endif